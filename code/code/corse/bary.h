@@ -2,9 +2,19 @@
 #define BARY_H
 #include "vec3.h"
 
-float interPolateCord(float val1, float val2, float val3, const Vec3f& bary);
+// интерполяция вызывается на каждый пиксель, поэтому встраивается
+inline float interPolateCord(float val1, float val2, float val3, const Vec3f& bary)
+{
+    return bary.x * val1 + bary.y * val2 + bary.z * val3;
+}
 
-Vec3f baryCentricInterpolation(const Vec3f& a, const Vec3f& b, const Vec3f& c, const Vec3f& bary);
+inline Vec3f baryCentricInterpolation(const Vec3f& a, const Vec3f& b, const Vec3f& c, const Vec3f& bary)
+{
+    float_t x = interPolateCord(a.x, b.x, c.x, bary);
+    float_t y = interPolateCord(a.y, b.y, c.y, bary);
+    float_t z = interPolateCord(a.z, b.z, c.z, bary);
+    return {x, y, z};
+}
 
 float calcBar(Vec3f a, Vec3f b, Vec3f p);
 
@@ -1,13 +1,17 @@
 ﻿#ifndef COLOR_SHADER_H
 #define COLOR_SHADER_H
 #include "shaders.h"
+#include "bary.h"
 #include <stdint.h>
 
-class ColorShader: public PixelShaderInterface
+// Шейдеры пикселей - обычные типы без виртуальных функций: растеризатор
+// инстанцируется для каждого шейдера, и его вызов встраивается в цикл по пикселям
+class ColorShader
 {
 public:
-    Vec3f shade(const Vertex &a, const Vertex &b, const Vertex &c, const Vec3f& bary) override;
-
-    ~ColorShader() override{}
+    Vec3f shade(const Vertex &a, const Vertex &b, const Vertex &c, const Vec3f& bary) const
+    {
+        return baryCentricInterpolation(a.color, b.color, c.color, bary);
+    }
 };
 #endif // COLOR_SHADER_H
@@ -10,16 +10,22 @@ CONFIG += c++17
 
 SOURCES += \
     bary.cpp \
+    denoiser.cpp \
+    depth_buffer.cpp \
+    flat_scene.cpp \
     geometry_shader.cpp \
+    light_tree.cpp \
     main.cpp \
     mainwindow.cpp \
     manager.cpp \
     model.cpp \
-    pixel_shader.cpp \
+    raster_pool.cpp \
     primitive.cpp \
+    preview_loop.cpp \
     raythread.cpp \
     raytraycing.cpp \
-    texture.cpp \
+    render_pool.cpp \
+    temporal.cpp \
     vertex_shader.cpp
 
 HEADERS += \
@@ -27,15 +33,27 @@ HEADERS += \
     bary.h \
     camera.h \
     color_shader.h \
+    denoiser.h \
+    depth_buffer.h \
+    flat_scene.h \
+    gbuffer.h \
     geometry_shader.h \
     light.h \
+    light_tree.h \
     mainwindow.h \
     mat.h \
     model.h \
     primitive.h \
+    preview_loop.h \
+    raster.h \
+    raster_pool.h \
     raythread.h \
+    render_pool.h \
+    sampling.h \
     scene_manager.h \
+    scene_snapshot.h \
     shaders.h \
+    temporal.h \
     texture.h \
     vec3.h \
     vec4.h \
@@ -0,0 +1,201 @@
+﻿#include "denoiser.h"
+#include "render_pool.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// ядро B3-сплайна 1/16 1/4 3/8 1/4 1/16, индекс - расстояние от центра
+const float atrous_kernel[3] = {3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+const float sigma_color = 0.6f, sigma_depth = 0.05f, sigma_albedo = 0.1f;
+const float albedo_min = 1e-3f;
+
+DenoiseBuffers::DenoiseBuffers(int width_, int height_): width{width_}, height{height_}
+{
+    int size = width * height;
+    for (auto v: {&nx, &ny, &nz, &depth, &ar, &ag, &ab, &r[0], &g[0], &b[0], &r[1], &g[1], &b[1]})
+        v->resize(size);
+}
+
+void DenoiseBuffers::storeHit(int i, const InterSectionData& hit)
+{
+    if (!hit.model)
+    {
+        nx[i] = ny[i] = nz[i] = 0.f;
+        depth[i] = denoise_miss_depth;
+        ar[i] = ag[i] = ab[i] = 1.f;
+        return;
+    }
+    nx[i] = hit.normal.x;
+    ny[i] = hit.normal.y;
+    nz[i] = hit.normal.z;
+    depth[i] = hit.t;
+    ar[i] = std::max(hit.color.x, albedo_min);
+    ag[i] = std::max(hit.color.y, albedo_min);
+    ab[i] = std::max(hit.color.z, albedo_min);
+}
+
+void DenoiseBuffers::storeColor(int i, const Vec3f& color)
+{
+    r[0][i] = color.x / ar[i];
+    g[0][i] = color.y / ag[i];
+    b[0][i] = color.z / ab[i];
+}
+
+static void filterPixel(DenoiseBuffers& d, int src, int x, int y, int step, float inv_sc2)
+{
+    int i = y * d.width + x;
+    int dst = src ^ 1;
+    if (d.depth[i] >= denoise_miss_depth)
+    {
+        d.r[dst][i] = d.r[src][i];
+        d.g[dst][i] = d.g[src][i];
+        d.b[dst][i] = d.b[src][i];
+        return;
+    }
+
+    float inv_sz = 1.f / (sigma_depth * step * std::max(d.depth[i], 1e-3f));
+    float inv_sa2 = 1.f / (sigma_albedo * sigma_albedo);
+    float sum_w = 0.f, sum_r = 0.f, sum_g = 0.f, sum_b = 0.f;
+
+    for (int dy = -2; dy <= 2; dy++)
+    {
+        int ty = y + dy * step;
+        if (ty < 0 || ty >= d.height)
+            continue;
+        for (int dx = -2; dx <= 2; dx++)
+        {
+            int tx = x + dx * step;
+            if (tx < 0 || tx >= d.width)
+                continue;
+            int j = ty * d.width + tx;
+
+            float cr = d.r[src][j] - d.r[src][i], cg = d.g[src][j] - d.g[src][i], cb = d.b[src][j] - d.b[src][i];
+            float wc = 1.f / (1.f + (cr * cr + cg * cg + cb * cb) * inv_sc2);
+
+            float wn = std::max(0.f, d.nx[i] * d.nx[j] + d.ny[i] * d.ny[j] + d.nz[i] * d.nz[j]);
+            for (int k = 0; k < 5; k++)
+                wn *= wn;
+
+            float wz = 1.f / (1.f + fabs(d.depth[j] - d.depth[i]) * inv_sz);
+
+            float dr = d.ar[j] - d.ar[i], dg = d.ag[j] - d.ag[i], db = d.ab[j] - d.ab[i];
+            float wa = 1.f / (1.f + (dr * dr + dg * dg + db * db) * inv_sa2);
+
+            float w = atrous_kernel[abs(dx)] * atrous_kernel[abs(dy)] * wc * wn * wz * wa;
+            sum_w += w;
+            sum_r += w * d.r[src][j];
+            sum_g += w * d.g[src][j];
+            sum_b += w * d.b[src][j];
+        }
+    }
+
+    d.r[dst][i] = sum_r / sum_w;
+    d.g[dst][i] = sum_g / sum_w;
+    d.b[dst][i] = sum_b / sum_w;
+}
+
+#ifdef __SSE2__
+// те же веса, что и в filterPixel, для четырёх соседних пикселей строки;
+// все отводы должны лежать внутри изображения по x
+static void filterPixels4(DenoiseBuffers& d, int src, int x, int y, int step, float inv_sc2)
+{
+    int i = y * d.width + x;
+    int dst = src ^ 1;
+    const __m128 one = _mm_set1_ps(1.f), zero = _mm_setzero_ps();
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    __m128 cr = _mm_loadu_ps(&d.r[src][i]), cg = _mm_loadu_ps(&d.g[src][i]), cb = _mm_loadu_ps(&d.b[src][i]);
+    __m128 cnx = _mm_loadu_ps(&d.nx[i]), cny = _mm_loadu_ps(&d.ny[i]), cnz = _mm_loadu_ps(&d.nz[i]);
+    __m128 cz = _mm_loadu_ps(&d.depth[i]);
+    __m128 car = _mm_loadu_ps(&d.ar[i]), cag = _mm_loadu_ps(&d.ag[i]), cab = _mm_loadu_ps(&d.ab[i]);
+
+    __m128 inv_sz = _mm_div_ps(one, _mm_mul_ps(_mm_set1_ps(sigma_depth * step), _mm_max_ps(cz, _mm_set1_ps(1e-3f))));
+    __m128 v_inv_sc2 = _mm_set1_ps(inv_sc2);
+    __m128 v_inv_sa2 = _mm_set1_ps(1.f / (sigma_albedo * sigma_albedo));
+    __m128 sum_w = zero, sum_r = zero, sum_g = zero, sum_b = zero;
+
+    for (int dy = -2; dy <= 2; dy++)
+    {
+        int ty = y + dy * step;
+        if (ty < 0 || ty >= d.height)
+            continue;
+        for (int dx = -2; dx <= 2; dx++)
+        {
+            int j = ty * d.width + x + dx * step;
+
+            __m128 tr = _mm_loadu_ps(&d.r[src][j]), tg = _mm_loadu_ps(&d.g[src][j]), tb = _mm_loadu_ps(&d.b[src][j]);
+            __m128 dr = _mm_sub_ps(tr, cr), dg = _mm_sub_ps(tg, cg), db = _mm_sub_ps(tb, cb);
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+            __m128 wc = _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(dist, v_inv_sc2)));
+
+            __m128 wn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cnx, _mm_loadu_ps(&d.nx[j])),
+                                              _mm_mul_ps(cny, _mm_loadu_ps(&d.ny[j]))),
+                                   _mm_mul_ps(cnz, _mm_loadu_ps(&d.nz[j])));
+            wn = _mm_max_ps(wn, zero);
+            for (int k = 0; k < 5; k++)
+                wn = _mm_mul_ps(wn, wn);
+
+            __m128 dz = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&d.depth[j]), cz), abs_mask);
+            __m128 wz = _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(dz, inv_sz)));
+
+            __m128 ar = _mm_sub_ps(_mm_loadu_ps(&d.ar[j]), car);
+            __m128 ag = _mm_sub_ps(_mm_loadu_ps(&d.ag[j]), cag);
+            __m128 ab = _mm_sub_ps(_mm_loadu_ps(&d.ab[j]), cab);
+            __m128 adist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ar, ar), _mm_mul_ps(ag, ag)), _mm_mul_ps(ab, ab));
+            __m128 wa = _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(adist, v_inv_sa2)));
+
+            __m128 w = _mm_mul_ps(_mm_set1_ps(atrous_kernel[abs(dx)] * atrous_kernel[abs(dy)]),
+                                  _mm_mul_ps(_mm_mul_ps(wc, wn), _mm_mul_ps(wz, wa)));
+            sum_w = _mm_add_ps(sum_w, w);
+            sum_r = _mm_add_ps(sum_r, _mm_mul_ps(w, tr));
+            sum_g = _mm_add_ps(sum_g, _mm_mul_ps(w, tg));
+            sum_b = _mm_add_ps(sum_b, _mm_mul_ps(w, tb));
+        }
+    }
+
+    // промахи (фон) не фильтруются
+    __m128 miss = _mm_cmpge_ps(cz, _mm_set1_ps(denoise_miss_depth));
+    auto select = [&](__m128 filtered, __m128 original)
+    {
+        return _mm_or_ps(_mm_and_ps(miss, original), _mm_andnot_ps(miss, filtered));
+    };
+    _mm_storeu_ps(&d.r[dst][i], select(_mm_div_ps(sum_r, sum_w), cr));
+    _mm_storeu_ps(&d.g[dst][i], select(_mm_div_ps(sum_g, sum_w), cg));
+    _mm_storeu_ps(&d.b[dst][i], select(_mm_div_ps(sum_b, sum_w), cb));
+}
+#endif
+
+void atrousPass(const RenderFrame& frame, const RayBound& bound, int pass)
+{
+    auto& d = *frame.denoise;
+    int step = 1 << pass;
+    int src = pass & 1, dst = src ^ 1;
+    // допуск по цвету уменьшается вдвое с каждым проходом
+    float inv_sc2 = float(1 << (2 * pass)) / (sigma_color * sigma_color);
+
+    for (int y = bound.ys; y <= bound.ye; y++)
+    {
+        int x = bound.xs;
+#ifdef __SSE2__
+        int simd_xs = std::min(std::max(bound.xs, 2 * step), bound.xe + 1);
+        int simd_xe = std::min(bound.xe, d.width - 1 - 2 * step) - 3;
+        for (; x < simd_xs; x++)
+            filterPixel(d, src, x, y, step, inv_sc2);
+        for (; x <= simd_xe; x += 4)
+            filterPixels4(d, src, x, y, step, inv_sc2);
+#endif
+        for (; x <= bound.xe; x++)
+            filterPixel(d, src, x, y, step, inv_sc2);
+
+        if (pass != denoise_passes - 1)
+            continue;
+        // последний проход: возвращаем альбедо и пишем в изображение
+        auto row = frame.pixels + y * frame.stride;
+        for (x = bound.xs; x <= bound.xe; x++)
+        {
+            int i = y * d.width + x;
+            auto color = Vec3f(d.r[dst][i] * d.ar[i], d.g[dst][i] * d.ag[i], d.b[dst][i] * d.ab[i]).saturate() * 255.f;
+            row[x] = qRgb(color.x, color.y, color.z);
+        }
+    }
+}
@@ -0,0 +1,32 @@
+﻿#ifndef DENOISER_H
+#define DENOISER_H
+#include <vector>
+#include "model.h"
+
+struct RenderFrame;
+struct RayBound;
+
+const int denoise_passes = 5;
+const float denoise_miss_depth = 1e30f;
+
+// Вспомогательные буферы первичных попаданий и рабочие буферы фильтра (SoA).
+// Фильтруется освещённость (цвет, делённый на альбедо), чтобы не размывать текстуры
+struct DenoiseBuffers
+{
+    DenoiseBuffers(int width_, int height_);
+
+    void storeHit(int i, const InterSectionData& hit);
+
+    void storeColor(int i, const Vec3f& color);
+
+    int width, height;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> depth;
+    std::vector<float> ar, ag, ab;
+    std::vector<float> r[2], g[2], b[2];
+};
+
+// один проход À-trous фильтра с шагом 2^pass; последний проход пишет результат в кадр
+void atrousPass(const RenderFrame& frame, const RayBound& bound, int pass);
+
+#endif // DENOISER_H
@@ -0,0 +1,45 @@
+﻿#include "depth_buffer.h"
+#include <algorithm>
+
+void DepthBuffer::resize(int width, int height)
+{
+    blocks_x = (width + depth_block - 1) / depth_block;
+    blocks_y = (height + depth_block - 1) / depth_block;
+    tiles_x = (blocks_x + tile_blocks - 1) / tile_blocks;
+    tiles_y = (blocks_y + tile_blocks - 1) / tile_blocks;
+    blocks.resize(blocks_x * blocks_y);
+    cleared.resize(blocks.size());
+    zmin.resize(blocks.size());
+    zmax.resize(blocks.size());
+    tile_max.resize(tiles_x * tiles_y);
+    clear();
+}
+
+void DepthBuffer::clear()
+{
+    std::fill(cleared.begin(), cleared.end(), 1);
+    std::fill(zmin.begin(), zmin.end(), depth_far);
+    std::fill(zmax.begin(), zmax.end(), depth_far);
+    std::fill(tile_max.begin(), tile_max.end(), depth_far);
+}
+
+// блок у края экрана неполный, но его лишние пиксели остаются дальними
+// и только делают оценку осторожнее
+void DepthBuffer::updateBlock(int bx, int by)
+{
+    int i = by * blocks_x + bx;
+    auto z = blocks[i].z;
+    auto range = std::minmax_element(z, z + depth_block * depth_block);
+    zmin[i] = *range.first;
+    zmax[i] = *range.second;
+}
+
+void DepthBuffer::updateTile(int tx, int ty)
+{
+    float value = std::numeric_limits<float>::lowest();
+    int bye = std::min((ty + 1) * tile_blocks, blocks_y), bxe = std::min((tx + 1) * tile_blocks, blocks_x);
+    for (int by = ty * tile_blocks; by < bye; by++)
+        for (int bx = tx * tile_blocks; bx < bxe; bx++)
+            value = std::max(value, zmax[by * blocks_x + bx]);
+    tile_max[ty * tiles_x + tx] = value;
+}
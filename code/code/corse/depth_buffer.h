@@ -0,0 +1,86 @@
+﻿#ifndef DEPTH_BUFFER_H
+#define DEPTH_BUFFER_H
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include "raster.h"
+
+const int depth_block = raster_block;
+const int tile_blocks = raster_tile / depth_block; // блоков по стороне тайла растеризации
+const float depth_far = std::numeric_limits<float>::max();
+// глубина - z/w из [0, 1], у дальней плоскости её шаг мал, поэтому допуск меньше
+// прежнего 1e-5 для z отсечения. Глубины ближе eps считаются равными
+const float depth_eps = 1e-6f;
+
+struct alignas(64) DepthBlock
+{
+    float z[depth_block * depth_block];
+};
+
+// Буфер глубины предпросмотра. Память идёт блоками 8x8 (построчно внутри блока и
+// построчно по блокам), и растеризатор, обходящий треугольник такими же блоками,
+// читает непрерывные 256 байт. Над блоками - грубый уровень Hi-Z: наименьшая
+// и наибольшая глубина блока и наибольшая глубина тайла растеризации, чтобы
+// отбрасывать заведомо закрытые треугольники и блоки без попиксельной проверки.
+// Очистка только помечает блоки, блок заполняется при первом обращении к нему
+class DepthBuffer
+{
+public:
+    void resize(int width, int height);
+
+    void clear();
+
+    // глубины блока (bx, by), очищенного при необходимости
+    float* block(int bx, int by)
+    {
+        int i = by * blocks_x + bx;
+        if (cleared[i])
+        {
+            std::fill(blocks[i].z, blocks[i].z + depth_block * depth_block, depth_far);
+            cleared[i] = 0;
+        }
+        return blocks[i].z;
+    }
+
+    float blockMin(int bx, int by) const
+    {
+        return zmin[by * blocks_x + bx];
+    }
+
+    float blockMax(int bx, int by) const
+    {
+        return zmax[by * blocks_x + bx];
+    }
+
+    float tileMax(int tx, int ty) const
+    {
+        return tile_max[ty * tiles_x + tx];
+    }
+
+    // пересчёт границ после записи в блок и в блоки тайла
+    void updateBlock(int bx, int by);
+
+    void updateTile(int tx, int ty);
+
+    // проверка глубины пикселя с записью при успехе
+    static bool testAndSet(float& stored, float z)
+    {
+        if (z < stored || std::fabs(z - stored) < depth_eps)
+        {
+            stored = z;
+            return true;
+        }
+        return false;
+    }
+
+private:
+    int blocks_x = 0, blocks_y = 0;
+    int tiles_x = 0, tiles_y = 0;
+    std::vector<DepthBlock> blocks;
+    std::vector<uint8_t> cleared;
+    std::vector<float> zmin, zmax;
+    std::vector<float> tile_max;
+};
+
+#endif // DEPTH_BUFFER_H
@@ -0,0 +1,139 @@
+﻿#include "flat_scene.h"
+#include "bary.h"
+
+const float eps_flat = std::numeric_limits<float>::epsilon();
+
+static Vec3f toWorld(const Vec3f& v, const Mat4x4f& matrix)
+{
+    Vec4f res(v);
+    res = res * matrix;
+    return Vec3f{res.x, res.y, res.z};
+}
+
+FlatScene::FlatScene(const std::vector<std::shared_ptr<const Model>>& models_): models{models_}
+{
+    size_t count = models.size();
+    specular.resize(count, 0.f);
+    reflective.resize(count, 0.f);
+    refractive.resize(count, 0.f);
+    n.resize(count, 0);
+
+    first.push_back(0);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto& model = *models[i];
+        if (!model.isObject())
+            continue;
+
+        specular[i] = model.specular;
+        reflective[i] = model.reflective;
+        refractive[i] = model.refractive;
+        n[i] = model.n;
+
+        objects.push_back(i);
+        box_min.push_back(model.box.lower());
+        box_max.push_back(model.box.upper());
+
+        auto objToWorld = model.objToWorld();
+        auto& rotation = model.rotation_matrix;
+        for (auto& face: model.mesh->faces)
+        {
+            auto a = toWorld(face.a.pos, objToWorld);
+            auto b = toWorld(face.b.pos, objToWorld);
+            auto c = toWorld(face.c.pos, objToWorld);
+            p0.push_back(a);
+            edge1.push_back(b - a);
+            edge2.push_back(c - a);
+            n0.push_back(toWorld(face.a.normal, rotation));
+            n1.push_back(toWorld(face.b.normal, rotation));
+            n2.push_back(toWorld(face.c.normal, rotation));
+        }
+        first.push_back(p0.size());
+    }
+}
+
+// тот же тест слоёв, что и BoundingBox::intersect, без виртуального вызова
+bool FlatScene::boxIntersect(int object, const Ray& r) const
+{
+    const Vec3f bounds[2] = {box_min[object], box_max[object]};
+
+    float tmin = (bounds[r.sign[0]].x - r.origin.x) * r.invdirection.x;
+    float tmax = (bounds[1-r.sign[0]].x - r.origin.x) * r.invdirection.x;
+    float tymin = (bounds[r.sign[1]].y - r.origin.y) * r.invdirection.y;
+    float tymax = (bounds[1-r.sign[1]].y - r.origin.y) * r.invdirection.y;
+
+    if ((tmin > tymax) || (tymin > tmax))
+        return false;
+    if (tymin > tmin)
+        tmin = tymin;
+    if (tymax < tmax)
+        tmax = tymax;
+
+    float tzmin = (bounds[r.sign[2]].z - r.origin.z) * r.invdirection.z;
+    float tzmax = (bounds[1-r.sign[2]].z - r.origin.z) * r.invdirection.z;
+
+    if ((tmin > tzmax) || (tzmin > tmax))
+        return false;
+    if (tzmin > tmin)
+        tmin = tzmin;
+    if (tzmax < tmax)
+        tmax = tzmax;
+
+    return (tmin < 0) == (tmax < 0);
+}
+
+// Мёллер-Трумбор по всем треугольникам объектов, чья оболочка пересекается лучом
+bool FlatScene::intersect(const Ray& ray, InterSectionData& data) const
+{
+    float closest_t = std::numeric_limits<float>::max();
+    int hit = -1, hit_object = -1;
+    float hit_u = 0.f, hit_v = 0.f;
+
+    for (size_t k = 0; k < objects.size(); k++)
+    {
+        if (!boxIntersect(k, ray))
+            continue;
+        for (int i = first[k]; i < first[k + 1]; i++)
+        {
+            auto h = Vec3f::cross(ray.direction, edge2[i]);
+            auto a = Vec3f::dot(edge1[i], h);
+            if (fabs(a) < eps_flat)
+                continue;
+
+            auto f = 1.f / a;
+            auto s = ray.origin - p0[i];
+            auto u = f * Vec3f::dot(s, h);
+            if (u < 0.f || u > 1.f)
+                continue;
+
+            auto q = Vec3f::cross(s, edge1[i]);
+            auto v = f * Vec3f::dot(ray.direction, q);
+            if (v < 0.f || u + v > 1.f)
+                continue;
+
+            float t = f * Vec3f::dot(edge2[i], q);
+            if (t > 0 && t < closest_t)
+            {
+                closest_t = t;
+                hit = i;
+                hit_object = k;
+                hit_u = u;
+                hit_v = v;
+            }
+        }
+    }
+    if (hit < 0)
+        return false;
+
+    int index = objects[hit_object];
+    auto& model = *models[index];
+    data.model = &model;
+    data.model_index = index;
+    data.face = hit - first[hit_object];
+    data.bary = Vec3f{1 - hit_u - hit_v, hit_u, hit_v};
+    data.t = closest_t;
+    data.point = ray.origin + ray.direction * closest_t;
+    data.normal = baryCentricInterpolation(n0[hit], n1[hit], n2[hit], data.bary).normalize();
+    data.color = model.surfaceColor(model.mesh->faces[data.face], data.bary);
+    return true;
+}
@@ -0,0 +1,40 @@
+﻿#ifndef FLAT_SCENE_H
+#define FLAT_SCENE_H
+#include <vector>
+#include <memory>
+#include "light.h"
+
+// Плоское представление сцены для трассировки: непрерывные массивы
+// вместо списка полиморфных моделей. Треугольники всех объектов переведены в мировые
+// координаты один раз на версию объектов, материалы хранятся по индексу модели,
+// источники света - в LightTree. Интерфейс Model для редактирования не меняется,
+// а предпросмотр и буфер видимости гибридного режима растеризуют модели напрямую.
+class FlatScene
+{
+public:
+    FlatScene(const std::vector<std::shared_ptr<const Model>>& models);
+
+    // ближайшее пересечение луча с объектами сцены
+    bool intersect(const Ray& ray, InterSectionData& data) const;
+
+public:
+    // объекты (модели, кроме источников света)
+    std::vector<int> objects;                 // индекс модели в снимке
+    std::vector<Vec3f> box_min, box_max;      // мировые ограничивающие оболочки
+    std::vector<int> first;                   // первый треугольник объекта, first[objects.size()] - их общее число
+
+    // треугольники всех объектов подряд: вершина, два ребра и нормали вершин
+    std::vector<Vec3f> p0, edge1, edge2;
+    std::vector<Vec3f> n0, n1, n2;
+
+    // материалы по индексу модели (у источников нулевые)
+    std::vector<float> specular, reflective, refractive;
+    std::vector<int> n;
+
+private:
+    bool boxIntersect(int object, const Ray& ray) const;
+
+    std::vector<std::shared_ptr<const Model>> models; // для цвета поверхности и номера грани
+};
+
+#endif // FLAT_SCENE_H
@@ -0,0 +1,50 @@
+﻿#ifndef GBUFFER_H
+#define GBUFFER_H
+#include <vector>
+#include "vec3.h"
+
+// Первичное попадание луча через пиксель
+struct GBufferTexel
+{
+    int model = -1; // индекс модели в снимке сцены, -1 - промах
+    int face = 0;
+    Vec3f bary;
+    Vec3f point;
+    Vec3f normal;
+    float t = 0.f;
+};
+
+// Кэш первичных попаданий. Действителен, пока не менялись камера и геометрия,
+// поэтому после изменения материалов освещение пересчитывается без первичных лучей
+struct GBuffer
+{
+    GBuffer(int width_, int height_, uint64_t geometry_version_):
+        width{width_}, height{height_}, geometry_version{geometry_version_}, texels(width_ * height_){}
+
+    int width, height;
+    uint64_t geometry_version;
+    bool approximate = false; // заполнен растеризатором или перенесён из предыдущего кадра, а не первичными лучами
+    std::vector<GBufferTexel> texels;
+};
+
+const size_t light_cache_limit = 64 << 20; // байт на видимость источников, при большем кэш не ведётся
+
+// Видимость источников из первичных попаданий: по байту на источник в пикселе
+// (1 - точка освещена, 0 - в тени, позади поверхности или вне радиуса действия),
+// источники нумеруются в порядке моделей сцены. Вместе с попаданиями из GBuffer этого
+// хватает, чтобы пересчитать прямое освещение с новыми интенсивностями без трассировки.
+// Отражённый и преломлённый цвет от интенсивностей тоже зависит, поэтому кадр с такими
+// попаданиями пересчитывается трассировкой. Действителен, пока менялись только интенсивности источников
+struct LightCache
+{
+    LightCache(int width_, int height_, int lights_, uint64_t shading_version_):
+        width{width_}, height{height_}, lights{lights_}, shading_version{shading_version_},
+        visibility(size_t(width_) * height_ * lights_){}
+
+    int width, height;
+    int lights;
+    uint64_t shading_version;
+    std::vector<uint8_t> visibility;
+};
+
+#endif // GBUFFER_H
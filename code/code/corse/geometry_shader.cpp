@@ -1,6 +1,6 @@
 ﻿#include "geometry_shader.h"
 
-Vertex GeometryShader::shade(const Vertex &a, const Mat4x4f &projection, const Mat4x4f& camView)
+Vertex GeometryShader::shade(const Vertex &a, const Mat4x4f &projection, const Mat4x4f& camView) const
 {
     Vec4f res(a.pos);
     res = res * camView;
@@ -3,11 +3,10 @@
 #include "shaders.h"
 
 const float eps =  1e-5f;
-class GeometryShader: public GeometryShaderInterface
+class GeometryShader
 {
 public:
     Vertex shade(const Vertex &a,
-                 const Mat4x4f& projection, const Mat4x4f& camView) override;
-    ~GeometryShader() override{}
+                 const Mat4x4f& projection, const Mat4x4f& camView) const;
 };
 #endif // GEOMETRY_SHADER_H
@@ -4,6 +4,7 @@
 
 const float ambInt = 0.3f;
 const int light_n = 1;
+const float light_range = 20.f; // радиус действия точечного источника с lightning_power = 1
 
 class Light: public Model
 {
@@ -64,14 +65,25 @@ public:
         Model::rotateZ(-angle);
     }
 
-    Vec3f getDirection()
+    // дальше этого расстояния точечный источник не освещает
+    float range() const
+    {
+        return lightning_power * light_range;
+    }
+
+    Vec3f getDirection() const
     {
         Vec4f temp(direction);
         temp = temp * rotation_matrix;
         return Vec3f{temp.x, temp.y, temp.z}.normalize();
     }
 
-    virtual bool isObject() override{return false;}
+    virtual bool isObject() const override{return false;}
+
+    virtual std::shared_ptr<Model> clone() const override
+    {
+        return std::make_shared<Light>(*this);
+    }
 
     virtual ~Light(){}
 
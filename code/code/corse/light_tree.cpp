@@ -0,0 +1,156 @@
+﻿#include "light_tree.h"
+#include <algorithm>
+
+static float distanceToBox(const Vec3f& p, const Vec3f& min, const Vec3f& max)
+{
+    float dx = std::max({min.x - p.x, 0.f, p.x - max.x});
+    float dy = std::max({min.y - p.y, 0.f, p.y - max.y});
+    float dz = std::max({min.z - p.z, 0.f, p.z - max.z});
+    return std::sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+LightTree::LightTree(const std::vector<std::shared_ptr<const Model>>& models)
+{
+    for (auto& model: models)
+    {
+        if (model->isObject())
+            continue;
+        auto light = static_cast<const Light*>(model.get());
+        int slot = count++;
+        intensity.push_back(light->color_intensity);
+        switch (light->t)
+        {
+            case Light::light_type::ambient:
+                // как и раньше, учитывается только первый фоновый источник
+                if (ambient_slot < 0)
+                {
+                    ambient = light->color_intensity;
+                    ambient_slot = slot;
+                }
+                break;
+            case Light::light_type::directional:
+                directional.push_back(DirectionalLightEntry{light->getDirection(), light->color_intensity, slot});
+                break;
+            default:
+            {
+                auto& c = light->color_intensity;
+                float power = std::max(0.f, 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z);
+                points.push_back(PointLightEntry{light->position, c, light->range(), power, slot});
+            }
+        }
+    }
+    if (!points.empty())
+    {
+        nodes.reserve(2 * points.size());
+        build(0, points.size());
+    }
+}
+
+// делит источники пополам по самой длинной оси их положений
+int LightTree::build(int begin, int end)
+{
+    int index = nodes.size();
+    nodes.push_back(LightTreeNode());
+
+    float inf = std::numeric_limits<float>::infinity();
+    LightTreeNode node = {{inf, inf, inf}, {-inf, -inf, -inf}, 0.f, 0.f, -1, -1, -1};
+    for (int i = begin; i < end; i++)
+    {
+        auto& p = points[i].position;
+        node.min = {std::min(node.min.x, p.x), std::min(node.min.y, p.y), std::min(node.min.z, p.z)};
+        node.max = {std::max(node.max.x, p.x), std::max(node.max.y, p.y), std::max(node.max.z, p.z)};
+        node.radius = std::max(node.radius, points[i].radius);
+        node.power += points[i].power;
+    }
+
+    if (end - begin == 1)
+        node.light = begin;
+    else
+    {
+        auto extent = node.max - node.min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        auto key = [axis](const PointLightEntry& l)
+        {
+            return axis == 0 ? l.position.x : axis == 1 ? l.position.y : l.position.z;
+        };
+        int mid = (begin + end) / 2;
+        std::nth_element(points.begin() + begin, points.begin() + mid, points.begin() + end,
+                         [&](const PointLightEntry& a, const PointLightEntry& b){ return key(a) < key(b); });
+        node.left = build(begin, mid);
+        node.right = build(mid, end);
+    }
+    nodes[index] = node;
+    return index;
+}
+
+// оценка вклада источников узла: яркость с ослаблением на ближайшем расстоянии;
+// для листа - с косинусом к нормали, для узла - 0, если все источники позади поверхности
+float LightTree::importance(const LightTreeNode& node, const Vec3f& p, const Vec3f& n) const
+{
+    float falloff = lightFalloff(distanceToBox(p, node.min, node.max), node.radius);
+    if (falloff <= 0.f)
+        return 0.f;
+    if (node.light >= 0)
+    {
+        auto dir = (points[node.light].position - p).normalize();
+        return node.power * falloff * std::max(0.f, Vec3f::dot(dir, n));
+    }
+    // наибольшее скалярное произведение по углам оболочки
+    float front = (n.x > 0 ? node.max.x - p.x : node.min.x - p.x) * n.x +
+                  (n.y > 0 ? node.max.y - p.y : node.min.y - p.y) * n.y +
+                  (n.z > 0 ? node.max.z - p.z : node.min.z - p.z) * n.z;
+    return front > 0.f ? node.power * falloff : 0.f;
+}
+
+void LightTree::collect(const Vec3f& p, std::vector<int>& out) const
+{
+    out.clear();
+    if (nodes.empty())
+        return;
+    int stack[64], top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        auto& node = nodes[stack[--top]];
+        if (distanceToBox(p, node.min, node.max) >= node.radius)
+            continue;
+        if (node.light >= 0)
+            out.push_back(node.light);
+        else
+        {
+            stack[top++] = node.left;
+            stack[top++] = node.right;
+        }
+    }
+}
+
+int LightTree::sample(const Vec3f& p, const Vec3f& n, float u, float& pdf) const
+{
+    pdf = 1.f;
+    if (nodes.empty())
+        return -1;
+    int index = 0;
+    while (nodes[index].light < 0)
+    {
+        auto& node = nodes[index];
+        float l = importance(nodes[node.left], p, n), r = importance(nodes[node.right], p, n);
+        if (l + r <= 0.f)
+            return -1;
+        float pl = l / (l + r);
+        // u переиспользуется на следующем уровне после растяжения на выбранную часть
+        if (u < pl)
+        {
+            index = node.left;
+            u = u / pl;
+            pdf *= pl;
+        }
+        else
+        {
+            index = node.right;
+            u = (u - pl) / (1.f - pl);
+            pdf *= 1.f - pl;
+        }
+        u = std::min(u, 0.99999994f);
+    }
+    return importance(nodes[index], p, n) > 0.f ? nodes[index].light : -1;
+}
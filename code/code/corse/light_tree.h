@@ -0,0 +1,94 @@
+﻿#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include "light.h"
+
+// ослабление точечного источника: гладко спадает до нуля на радиусе действия
+inline float lightFalloff(float distance, float radius)
+{
+    if (distance >= radius)
+        return 0.f;
+    float x = distance / radius;
+    x *= x;
+    float w = 1.f - x * x;
+    return w * w;
+}
+
+// освещённость точки с нормалью normal от источника единичной интенсивности в направлении
+// light_dir без учёта тени: диффузная и зеркальная (для луча view) части
+inline float lightTerm(const Vec3f& light_dir, const Vec3f& normal, const Vec3f& view, float specular, float n)
+{
+    // источник позади поверхности не освещает её (и не даёт блика)
+    auto tDot = Vec3f::dot(light_dir, normal);
+    if (tDot <= 0.f)
+        return 0.f;
+    float term = tDot * (1 - specular);
+    if (fabs(specular) >= 1e-5)
+    {
+        auto r = (light_dir - normal * 2.f * tDot).normalize();
+        term += powf(std::max(0.f, Vec3f::dot(r, view)), n) * specular;
+    }
+    return term;
+}
+
+// Параметры источников на момент снимка. slot - номер источника среди всех
+// источников сцены в порядке моделей (см. LightCache)
+struct PointLightEntry
+{
+    Vec3f position;
+    Vec3f intensity;
+    float radius;
+    float power; // яркость для выбора по важности
+    int slot;
+};
+
+struct DirectionalLightEntry
+{
+    Vec3f direction;
+    Vec3f intensity;
+    int slot;
+};
+
+struct LightTreeNode
+{
+    Vec3f min, max;    // границы положений источников
+    float radius;      // наибольший радиус действия
+    float power;       // суммарная яркость
+    int left, right;   // дочерние узлы, у листа -1
+    int light;         // номер источника в points у листа, иначе -1
+};
+
+// Источники света сцены, точечные - в иерархии ограничивающих объёмов.
+// Позволяет перебирать только источники, достающие до точки, и выбирать
+// источники случайно пропорционально их возможному вкладу
+class LightTree
+{
+public:
+    LightTree(const std::vector<std::shared_ptr<const Model>>& models);
+
+    // точечные источники, в радиус действия которых попадает p
+    void collect(const Vec3f& p, std::vector<int>& out) const;
+
+    // случайный точечный источник с вероятностью pdf для точки p с нормалью n,
+    // -1 - ни один источник не освещает точку
+    int sample(const Vec3f& p, const Vec3f& n, float u, float& pdf) const;
+
+public:
+    std::vector<PointLightEntry> points;
+    std::vector<DirectionalLightEntry> directional;
+    Vec3f ambient = {0.f, 0.f, 0.f};
+    int ambient_slot = -1;
+    std::vector<Vec3f> intensity; // интенсивности всех источников по номеру slot
+    int count = 0; // всего источников
+
+private:
+    int build(int begin, int end);
+    float importance(const LightTreeNode& node, const Vec3f& p, const Vec3f& n) const;
+
+    std::vector<LightTreeNode> nodes;
+};
+
+#endif // LIGHT_TREE_H
@@ -23,12 +23,20 @@ MainWindow::MainWindow(QWidget *parent)
 
     auto f = [&](trans_type t, float dist){
         manager.moveCamera(t, dist);
+        traceAfterCameraMove();
     };
 
     auto filter = new Filter(f);
     ui->canvas->installEventFilter(filter);
 
     manager = SceneManager(width, height, Qt::black, ui->canvas->scene());
+    connect(manager.renderPool(), SIGNAL(frameFinished()), this, SLOT(traceFinished()));
+    connect(manager.renderPool(), SIGNAL(batchFinished()), this, SLOT(turntableFinished()));
+    connect(manager.previewLoop(), SIGNAL(frameReady()), this, SLOT(previewFinished()));
+
+    ui->canvas->setDragMode(QGraphicsView::RubberBandDrag);
+    connect(ui->canvas, SIGNAL(rubberBandChanged(QRect, QPointF, QPointF)),
+            this, SLOT(selectRegion(QRect, QPointF, QPointF)));
 
     const QStringList textures = {
         "Куб",
@@ -44,6 +52,10 @@ MainWindow::MainWindow(QWidget *parent)
 
     ui->add_light_list->addItems(lights);
 
+    const QStringList trace_modes = {"Трассировка лучей", "Трассировка путей", "Гибридный"};
+
+    ui->trace_mode_list->addItems(trace_modes);
+
     auto stringList = new QStringList();
     model = new QStringListModel(*stringList);
 
@@ -233,71 +245,64 @@ void MainWindow::fetch(QModelIndex index){
     prev_selected = text;
 }
 
-void MainWindow::disableAll(bool flag){
-
-    ui->ambient_spin->setEnabled(flag);
-    ui->glitter_spin->setEnabled(flag);
-    ui->reflection_spin->setEnabled(flag);
-    ui->transparency_spin->setEnabled(flag);
-
-    ui->scale_x_spin->setEnabled(flag);
-    ui->scale_y_spin->setEnabled(flag);
-    ui->scale_z_spin->setEnabled(flag);
-
-    ui->rotate_x_spin->setEnabled(flag);
-    ui->rotate_y_spin->setEnabled(flag);
-    ui->rotate_z_spin->setEnabled(flag);
-
-    ui->offset_x_spin->setEnabled(flag);
-    ui->offset_y_spin->setEnabled(flag);
-    ui->offset_z_spin->setEnabled(flag);
-
-    ui->color_flag->setEnabled(flag);
-    ui->texture_flag->setEnabled(flag);
-    ui->add_texture_button->setEnabled(flag);
-    ui->color_add_button->setEnabled(flag);
-
-    ui->scene_list->setEnabled(flag);
-    ui->objects_list->setEnabled(flag);
-    ui->add_light_list->setEnabled(flag);
-
-    ui->intensity_spin->setEnabled(flag);
-    ui->ambient_spin->setEnabled(flag);
-
-    ui->add_light_button->setEnabled(flag);
-    ui->add_object_button->setEnabled(flag);
-
-    ui->delete_object_button->setEnabled(flag);
-
-}
-
 void MainWindow::on_render_button_clicked()
 {
-    if (isLocked){
-        disableAll(true);
-        isLocked = false;
-        manager.render();
+    if (progressive){
+        // остановка: текущий кадр дорисуется и останется на экране
+        progressive = false;
+        ui->render_button->setText("Рендер");
+        ui->render_button->setEnabled(false);
         return;
     }
-    threads = manager.trace();
-    if (threads){
-        for (auto& th: *threads){
-            QObject::connect(th, SIGNAL(finished()), this, SLOT(checkThread()));
-            th->start();
-        }
-        th_amount = threads->size();
-        disableAll(false);
-        isLocked = true;
+    // трассировка работает со снимком сцены, поэтому редактирование не блокируется
+    if (!manager.trace())
+        return;
+    if (ui->trace_mode_list->currentIndex() == path_tracing){
+        progressive = true;
+        ui->render_button->setText("Стоп");
+    }
+    else
         ui->render_button->setEnabled(false);
+}
+
+void MainWindow::previewFinished(){
+    manager.showPreview();
+}
+
+void MainWindow::traceFinished(){
+    manager.showTracedResult();
+    if (progressive){
+        ui->statusbar->showMessage(QString("Отсчётов на пиксель: %1").arg(manager.accumulatedSamples()));
+        manager.trace();
+        return;
     }
+    if (trace_pending){
+        trace_pending = false;
+        manager.trace();
+        return;
+    }
+    ui->render_button->setEnabled(true);
 }
 
-void MainWindow::checkThread(){
-    QMutexLocker ml(&mutex);
-    if (--th_amount == 0){
-        manager.showTracedResult();
-        ui->render_button->setEnabled(true);
+// при перепроецировании кадр трассируется после каждого движения камеры
+void MainWindow::traceAfterCameraMove()
+{
+    if (ui->temporal_flag->isChecked())
+        retrace();
+}
+
+// трассировка показанного кадра заново; если предыдущий ещё не готов,
+// запросы копятся до его завершения. Трассировка путей и так идёт кадр за кадром
+void MainWindow::retrace()
+{
+    if (progressive)
+        return;
+    if (!ui->render_button->isEnabled()){
+        trace_pending = true;
+        return;
     }
+    if (manager.trace())
+        ui->render_button->setEnabled(false);
 }
 
 void MainWindow::on_rotate_x_spin_valueChanged(double arg1)
@@ -526,10 +531,113 @@ void MainWindow::on_transparency_spin_valueChanged(double arg1)
 
 void MainWindow::on_intensity_spin_valueChanged(double arg1)
 {
-    manager.setIntensity(arg1);
+    if (!manager.setIntensity(arg1))
+        retrace();
 }
 
 void MainWindow::on_ambient_spin_valueChanged(double arg1)
 {
-    manager.setAmbIntensity(arg1);
+    if (!manager.setAmbIntensity(arg1))
+        retrace();
+}
+
+void MainWindow::updateAntialiasing()
+{
+    manager.setAntialiasing(ui->aa_flag->isChecked(), ui->aa_samples_spin->value(),
+                            ui->aa_threshold_spin->value());
+}
+
+void MainWindow::on_aa_flag_clicked()
+{
+    updateAntialiasing();
+}
+
+void MainWindow::on_aa_samples_spin_valueChanged(int arg1)
+{
+    updateAntialiasing();
+}
+
+void MainWindow::on_aa_threshold_spin_valueChanged(double arg1)
+{
+    updateAntialiasing();
+}
+
+void MainWindow::on_trace_mode_list_currentIndexChanged(int index)
+{
+    if (progressive)
+        on_render_button_clicked();
+    manager.setTraceMode(static_cast<trace_mode>(index));
+}
+
+void MainWindow::on_denoise_flag_clicked()
+{
+    manager.setDenoise(ui->denoise_flag->isChecked());
+}
+
+void MainWindow::on_temporal_flag_clicked()
+{
+    manager.setTemporal(ui->temporal_flag->isChecked());
+}
+
+void MainWindow::updateTimeBudget()
+{
+    manager.setTimeBudget(ui->budget_flag->isChecked() ? ui->budget_spin->value() : 0);
+}
+
+void MainWindow::on_budget_flag_clicked()
+{
+    updateTimeBudget();
+}
+
+void MainWindow::on_budget_spin_valueChanged(int arg1)
+{
+    updateTimeBudget();
+}
+
+// по окончании выделения Qt сообщает пустой прямоугольник, поэтому запоминается последний
+void MainWindow::selectRegion(QRect viewport_rect, QPointF from, QPointF to)
+{
+    if (viewport_rect.isNull())
+        return;
+    region = QRectF(from, to).normalized().toRect();
+    ui->statusbar->showMessage(QString("Область: %1, %2  %3 x %4").arg(region.x()).arg(region.y())
+                               .arg(region.width()).arg(region.height()));
+}
+
+void MainWindow::on_roi_button_clicked()
+{
+    if (progressive || !ui->render_button->isEnabled())
+        return;
+    if (region.isEmpty()){
+        ui->statusbar->showMessage("Выделите область на изображении мышью");
+        return;
+    }
+    RayBound roi = {region.left(), region.right(), region.top(), region.bottom()};
+    if (manager.traceRegion(roi, ui->roi_ss_flag->isChecked()))
+        ui->render_button->setEnabled(false);
+}
+
+const int turntable_views = 12;
+
+void MainWindow::on_turntable_button_clicked()
+{
+    if (progressive || !ui->render_button->isEnabled())
+        return;
+    turntable_dir = QFileDialog::getExistingDirectory(this, "Папка для кадров обзора");
+    if (turntable_dir.isEmpty())
+        return;
+    if (manager.traceTurntable(turntable_views)){
+        ui->render_button->setEnabled(false);
+        ui->turntable_button->setEnabled(false);
+    }
+}
+
+void MainWindow::turntableFinished(){
+    auto images = manager.batchImages();
+    QDir dir(turntable_dir);
+    for (size_t i = 0; i < images.size(); i++)
+        images[i].save(dir.filePath(QString("view_%1.png").arg(i, 2, 10, QChar('0'))));
+    ui->statusbar->showMessage(QString("Сохранено кадров: %1").arg(images.size()));
+    ui->render_button->setEnabled(true);
+    ui->turntable_button->setEnabled(true);
 }
@@ -5,6 +5,7 @@
 #include <QStringListModel>
 #include <QColorDialog>
 #include <QFileDialog>
+#include <QDir>
 #include "scene_manager.h"
 
 const float intensityLight = 1.f;
@@ -44,7 +45,9 @@ public:
 
 public slots:
 
-    void checkThread();
+    void traceFinished();
+
+    void previewFinished();
 
 private slots:
     void fetch(QModelIndex index);
@@ -102,9 +105,37 @@ private slots:
 
     void on_ambient_spin_valueChanged(double arg1);
 
-private:
+    void on_aa_flag_clicked();
+
+    void on_aa_samples_spin_valueChanged(int arg1);
+
+    void on_aa_threshold_spin_valueChanged(double arg1);
+
+    void updateAntialiasing();
+
+    void on_trace_mode_list_currentIndexChanged(int index);
+
+    void on_denoise_flag_clicked();
+
+    void on_temporal_flag_clicked();
+
+    void traceAfterCameraMove();
 
-    void disableAll(bool flag);
+    void retrace();
+
+    void on_budget_flag_clicked();
+
+    void on_budget_spin_valueChanged(int arg1);
+
+    void updateTimeBudget();
+
+    void selectRegion(QRect viewport_rect, QPointF from, QPointF to);
+
+    void on_roi_button_clicked();
+
+    void on_turntable_button_clicked();
+
+    void turntableFinished();
 
 private:
     Ui::MainWindow *ui;
@@ -113,10 +144,11 @@ private:
     std::map<QString, UI_data> name_data;
     QString prev_selected = "";
 
-    ThreadVector* threads;
-    int th_amount = 0;
-    QMutex mutex;
-    bool isLocked = false;
+    bool progressive = false; // трассировка путей идёт кадр за кадром до остановки
+    bool trace_pending = false; // кадр устарел, пока трассировался предыдущий
+    QRect region; // выделенная на изображении область для повторной трассировки
+    QString turntable_dir; // папка для кадров кругового обзора
+
 };
 
 class Filter: public QObject
@@ -2,183 +2,767 @@
 #include "bary.h"
 #include "texture.h"
 #include "geometry_shader.h"
+#include "raster.h"
+#include "depth_buffer.h"
 
 #define NDCX_TO_RASTER(ndc_x, width) (((ndc_x + 1.0f) * (width >> 1)))
 #define NDCY_TO_RASTER(ndc_y, height) (((1.0f - ndc_y) * (height >> 1)))
 void denormolize(int width, int height, Vertex& v){
     v.pos.x = v.pos.x * v.invW;
     v.pos.y = v.pos.y * v.invW;
+    // глубина z/w линейна на экране, в отличие от z отсечения
+    v.pos.z = v.pos.z * v.invW;
 
     v.pos.x = NDCX_TO_RASTER(v.pos.x, width);
     v.pos.y = NDCY_TO_RASTER(v.pos.y, height);
 }
 
 
+// цвет фрагмента по шейдеру пикселей модели
+template<typename PixelShader>
+static inline QRgb shadeFragment(const RasterTriangle& tri, const PixelShader& shader, const Vec3f& bary)
+{
+    auto pixel_color = shader.shade(tri.v[0], tri.v[1], tri.v[2], bary) * 255.f;
+    return qRgb(pixel_color.x, pixel_color.y, pixel_color.z);
+}
+
 void SceneManager::init()
 {
-    models.push_back(new Light(Light::light_type::ambient));
-    pixel_shader = std::make_shared<ColorShader>();
-    vertex_shader = std::make_shared<VertexShader>();
-    geom_shader = std::make_shared<GeometryShader>();
-    render_all();
+    models.push_back(std::make_shared<Light>(Light::light_type::ambient));
+    requestPreview();
 }
 
 void SceneManager::render()
 {
-    this->render_all();
+    requestPreview();
+}
+
+// кадр предпросмотра по текущему состоянию сцены. Пока предыдущий кадр не показан,
+// изменения только отмечаются, и их итог захватывается одним кадром после показа:
+// за кадр изменяемая модель копируется не больше одного раза
+void SceneManager::requestPreview()
+{
+    if (preview_busy)
+    {
+        preview_dirty = true;
+        return;
+    }
+    auto state = std::make_shared<PreviewScene>(camers[curr_camera], deferred_shading, preview_epoch);
+    state->models.reserve(models.size());
+    for (auto& model: models)
+    {
+        // оболочка сбрасывается при каждом преобразовании модели (копии, если модель
+        // уже захвачена), поэтому поток предпросмотра получает модели только для чтения
+        if (!model->box_valid && !model->mesh->index_buffer.empty())
+            model->genBox();
+        state->models.push_back(model);
+    }
+    preview_busy = true;
+    preview_dirty = false;
+    preview->submit(state, [this](const PreviewScene& captured, PreviewFrame& frame)
+    {
+        render_all(captured, frame);
+    });
 }
 
-void SceneManager::render_all()
+void SceneManager::showPreview()
 {
+    if (!preview->take(preview_frame))
+        return;
+    preview_busy = false;
+    // трассированное изображение, показанное после захвата сцены, кадр не заменяет
+    if (preview_frame.epoch == preview_epoch)
+    {
+        show(preview_frame.image);
+        traced_shown = false;
+    }
+    if (preview_dirty)
+        requestPreview();
+}
 
-    img.fill(Qt::black);
+// выполняется в потоке предпросмотра: кроме state и frame, использует только
+// буферы preview_raster, которые не трогает поток интерфейса
+void SceneManager::render_all(const PreviewScene& state, PreviewFrame& frame)
+{
+    if (frame.image.width() != width || frame.image.height() != height)
+        frame.image = QImage(width, height, QImage::Format_RGB32);
+    frame.image.fill(Qt::black);
+    frame.epoch = state.epoch;
+
+    auto& buffers = preview_raster;
+    auto& stats = frame.stats;
+    stats = RasterStats();
+    setupPass(buffers, state.models, state.camera, false, stats);
+    for (int chunk = 0; chunk < buffers.chunks; chunk++)
+        stats.rasterized += buffers.triangles[chunk].size();
+
+    bool deferred_shading = state.deferred;
+    if (deferred_shading)
+        buffers.visibility.resize(width * height);
+    QRgb* pixels = reinterpret_cast<QRgb*>(frame.image.bits());
+    int stride = frame.image.bytesPerLine() / sizeof(QRgb);
+    buffers.pool->forEach(buffers.tiles, [&](int tile)
+    {
+        int x0 = (tile % buffers.tiles_x) * raster_tile, y0 = (tile / buffers.tiles_x) * raster_tile;
+        int x1 = std::min(x0 + raster_tile, width) - 1, y1 = std::min(y0 + raster_tile, height) - 1;
+        // при отложенном затенении треугольники пишут только глубину и свой номер в пикселе,
+        // а затеняется после них каждый видимый пиксель ровно один раз
+        if (deferred_shading)
+        {
+            for (int y = y0; y <= y1; y++)
+                std::fill_n(&buffers.visibility[y * width + x0], x1 - x0 + 1, nullptr);
+            drawTile(buffers, tile, [&](const RasterTriangle& tri)
+            {
+                return rasterTriangle(buffers.depth, tri, x0, y0, x1, y1, [&](int x, int y, const Vec3f&)
+                {
+                    buffers.visibility[y * width + x] = &tri;
+                });
+            });
+            shadeVisible(buffers, x0, y0, x1, y1, pixels, stride);
+            return;
+        }
+        drawTile(buffers, tile, [&](const RasterTriangle& tri)
+        {
+            auto forward = [&](const auto& shader)
+            {
+                return rasterTriangle(buffers.depth, tri, x0, y0, x1, y1, [&](int x, int y, const Vec3f& bary)
+                {
+                    pixels[y * stride + x] = shadeFragment(tri, shader, bary);
+                });
+            };
+            auto& draw = buffers.draws[tri.draw];
+            return draw.shading == PixelShading::texture ? forward(TextureShader(draw.model->texture)) :
+                                                           forward(ColorShader());
+        });
+    });
+}
 
-    for (auto& vec: depthBuffer)
-        std::fill(vec.begin(), vec.end(), std::numeric_limits<float>::max());
+// Общая часть проходов растеризации - всё до растеризации тайлов.
+// Растеризация с сортировкой в середине конвейера: сначала параллельно по группам
+// треугольников вершинная обработка и раскладка по экранным тайлам, затем параллельно
+// по тайлам растеризация. Тайл целиком принадлежит одному потоку, поэтому буферы
+// глубины и цвета не блокируются, а порядок треугольников в тайле прежний.
+// Проход буфера видимости (visibility) берёт только объекты, как трассировщик,
+// и не отбрасывает нелицевые грани: луч попадает и в них
+void SceneManager::setupPass(RasterBuffers& buffers, const std::vector<std::shared_ptr<const Model>>& scene_models,
+                             const Camera& cam, bool visibility, RasterStats& stats)
+{
+    buffers.depth.clear();
 
-    for (auto& model: models)
+    auto viewMatrix = cam.viewMatrix();
+    auto projMatrix = cam.projectionMatrix;
+    auto viewProj = viewMatrix * projMatrix;
+    Frustum frustum(viewProj);
+
+    auto& draws = buffers.draws;
+    auto& clusters = buffers.clusters;
+    draws.clear();
+    clusters.clear();
+    int total = 0, vertices = 0;
+    for (size_t index = 0; index < scene_models.size(); index++)
     {
-        if (!model->isObject())
+        auto& model = scene_models[index];
+        // тип источника известен по isObject, RTTI не нужен
+        if (!model->isObject() && (visibility || static_cast<const Light&>(*model).t == Light::light_type::ambient))
+            continue;
+        auto& mesh = *model->mesh;
+        if (mesh.index_buffer.empty())
+            continue;
+        int faces = mesh.index_buffer.size() / 3;
+        stats.models++;
+        stats.triangles += faces;
+        // модель вне кадра отбрасывается одной проверкой, без обработки вершин
+        if (frustum.outside(model->box))
         {
-            Light* l = dynamic_cast<Light*>(model);
-            if (l->t == Light::light_type::ambient) continue;
+            stats.culled_models++;
+            stats.culled_triangles += faces;
+            continue;
+        }
+        // шейдер пикселей выбирается один раз на модель, растеризатор для него уже инстанцирован
+        auto shading = model->has_texture && !model->texture.isNull() ? PixelShading::texture : PixelShading::color;
+        auto objToWorld = model->objToWorld();
+        int draw = draws.size();
+        draws.push_back(RasterDraw{model.get(), int(index), shading, model->rotation_matrix, objToWorld});
+
+        // кластеры отбрасываются до вершинной обработки: сфера - в мировых координатах
+        // (радиус растягивается наибольшим масштабом модели), конус нормалей - в
+        // координатах модели, куда переносится камера. Отражение меняет лицевую сторону
+        auto eye4 = Vec4f(cam.position) * Mat4x4f::Inverse(objToWorld);
+        Vec3f eye = {eye4.x, eye4.y, eye4.z};
+        auto& m = objToWorld.elements;
+        Vec3f rows[3] = {{m[0][0], m[0][1], m[0][2]}, {m[1][0], m[1][1], m[1][2]}, {m[2][0], m[2][1], m[2][2]}};
+        float stretch = std::max({rows[0].len(), rows[1].len(), rows[2].len()});
+        float side = Vec3f::dot(rows[0], Vec3f::cross(rows[1], rows[2])) < 0.f ? -1.f : 1.f;
+        for (auto& meshlet: mesh.meshlets)
+        {
+            stats.clusters++;
+            auto center = Vec4f(meshlet.center) * objToWorld;
+            if (frustum.outside(Vec3f{center.x, center.y, center.z}, meshlet.radius * stretch))
+            {
+                stats.frustum_clusters++;
+                stats.cluster_culled_triangles += meshlet.count;
+                continue;
+            }
+            if (!visibility && meshlet.backfacing(eye, side))
+            {
+                stats.backface_clusters++;
+                stats.cluster_culled_triangles += meshlet.count;
+                continue;
+            }
+            clusters.push_back(RasterCluster{draw, &meshlet, total, vertices});
+            total += meshlet.count;
+            vertices += meshlet.vertex_count;
         }
-        if (model->has_texture)
-            pixel_shader = std::make_shared<TextureShader>(model->texture);
-        else
-            pixel_shader = std::make_shared<ColorShader>();
-        rasterize(*model);
     }
 
-    show();
+    int chunks = (total + raster_chunk - 1) / raster_chunk;
+    int tiles_x = (width + raster_tile - 1) / raster_tile, tiles_y = (height + raster_tile - 1) / raster_tile;
+    int tiles = tiles_x * tiles_y;
+    buffers.chunks = chunks;
+    buffers.tiles_x = tiles_x;
+    buffers.tiles = tiles;
+    if (int(buffers.triangles.size()) < chunks)
+        buffers.triangles.resize(chunks);
+    if (int(buffers.bins.size()) < chunks * tiles)
+        buffers.bins.resize(chunks * tiles);
+
+    // кластер, которому принадлежит элемент с номером index в общей нумерации кадра
+    auto clusterOf = [&](int index, int RasterCluster::* first)
+    {
+        return std::upper_bound(clusters.begin(), clusters.end(), index,
+                                [first](int i, const RasterCluster& c){ return i < c.*first; }) - clusters.begin() - 1;
+    };
+
+    // вершинная обработка: каждая вершина оставшихся кластеров один раз за кадр,
+    // треугольники потом собираются по индексам. Шейдеры вершин не хранят
+    // состояния, поэтому вызываются из нескольких потоков
+    auto& frame_vertices = buffers.vertices;
+    frame_vertices.resize(vertices);
+    buffers.pool->forEach((vertices + raster_chunk - 1) / raster_chunk, [&](int chunk)
+    {
+        int begin = chunk * raster_chunk, end = std::min(begin + raster_chunk, vertices);
+        size_t cluster = clusterOf(begin, &RasterCluster::base);
+        for (int i = begin; i < end; i++)
+        {
+            while (cluster + 1 < clusters.size() && clusters[cluster + 1].base <= i)
+                cluster++;
+            auto& c = clusters[cluster];
+            auto& d = draws[c.draw];
+            auto& mesh = *d.model->mesh;
+            auto& vertex = mesh.vertex_buffer[mesh.meshlet_vertices[c.meshlet->vertex_first + i - c.base]];
+            auto world = vertex_shader.shade(vertex, d.rotation, d.objToWorld, cam);
+            frame_vertices.world[i] = world;
+            frame_vertices.clip[i] = Vec4f(world.pos) * viewProj;
+            frame_vertices.projected[i] = geom_shader.shade(world, projMatrix, viewMatrix);
+        }
+    });
+
+    buffers.pool->forEach(chunks, [&](int chunk)
+    {
+        auto bins = buffers.bins.begin() + chunk * tiles;
+        for (int t = 0; t < tiles; t++)
+            bins[t].clear();
+        auto& triangles = buffers.triangles[chunk];
+        triangles.clear();
+
+        int begin = chunk * raster_chunk, end = std::min(begin + raster_chunk, total);
+        size_t cluster = clusterOf(begin, &RasterCluster::first);
+        for (int i = begin; i < end; i++)
+        {
+            while (cluster + 1 < clusters.size() && clusters[cluster + 1].first <= i)
+                cluster++;
+            auto& c = clusters[cluster];
+            auto& d = draws[c.draw];
+            // грани модели упорядочены по кластерам, поэтому треугольник кластера - грань
+            // с тем же номером, и вершины у него в том же порядке
+            int face = c.meshlet->first + i - c.first;
+            const uint8_t* index = &d.model->mesh->meshlet_indices[3 * face];
+            int ids[3] = {c.base + index[0], c.base + index[1], c.base + index[2]};
+            size_t first = triangles.size();
+            setupFace(buffers, d, face, ids, viewMatrix, projMatrix, cam.position, !visibility, triangles);
+            for (size_t k = first; k < triangles.size(); k++)
+            {
+                auto& tri = triangles[k];
+                for (int ty = tri.sy / raster_tile; ty <= tri.ey / raster_tile; ty++)
+                    for (int tx = tri.sx / raster_tile; tx <= tri.ex / raster_tile; tx++)
+                        bins[ty * tiles_x + tx].push_back(k);
+            }
+        }
+    });
 }
 
-bool SceneManager::backfaceCulling(const Vertex &a, const Vertex &b, const Vertex &c)
+// треугольники тайла из всех групп в порядке отрисовки, кроме целиком закрытых уже
+// нарисованным в тайле. draw(tri) растеризует треугольник, true - записан хотя бы один пиксель
+template<typename Draw>
+void SceneManager::drawTile(RasterBuffers& buffers, int tile, Draw draw)
 {
-    auto cam = camers[curr_camera];
+    int tx = tile % buffers.tiles_x, ty = tile / buffers.tiles_x;
+    for (int chunk = 0; chunk < buffers.chunks; chunk++)
+    {
+        for (int i: buffers.bins[chunk * buffers.tiles + tile])
+        {
+            auto& tri = buffers.triangles[chunk][i];
+            if (tri.zmin - tri.margin > buffers.depth.tileMax(tx, ty) + depth_eps)
+                continue;
+            if (draw(tri))
+                buffers.depth.updateTile(tx, ty);
+        }
+    }
+}
 
+bool SceneManager::backfaceCulling(const Vertex &a, const Vertex &b, const Vertex &c, const Vec3f& eye)
+{
     auto face_normal = Vec3f::cross(b.pos - a.pos, c.pos - a.pos);
 
-    auto res1 = Vec3f::dot(face_normal, a.pos - cam.position);
-    auto res2 = Vec3f::dot(face_normal, b.pos - cam.position);
-    auto res3 = Vec3f::dot(face_normal, c.pos - cam.position);
+    auto res1 = Vec3f::dot(face_normal, a.pos - eye);
+    auto res2 = Vec3f::dot(face_normal, b.pos - eye);
+    auto res3 = Vec3f::dot(face_normal, c.pos - eye);
 
     if ((res1 > 0) && (res2 > 0) && (res3 > 0))
         return true;
     return false;
 }
 
-bool SceneManager::clip(const Vertex& v)
+#define Min(val1, val2) std::min(val1, val2)
+#define Max(val1, val2) std::max(val1, val2)
+
+// вершина треугольника после отсечения: координаты отсечения и веса исходных вершин грани
+struct ClipVertex
 {
-    const float w = 1 / v.invW;
-    return (v.pos.x > -w || fabs(v.pos.x + w) < eps) &&
-           (v.pos.x < w || fabs(v.pos.x - w) < eps) &&
-           (v.pos.y > -w || fabs(v.pos.y + w) < eps) &&
-           (v.pos.y < w || fabs(v.pos.y - w) < eps) &&
-           (v.pos.z > 0.f || fabs(v.pos.z) < eps) &&
-           (v.pos.z < w || fabs(v.pos.z - w) < eps);
-}
+    Vec4f pos;
+    Vec3f weight;
+};
 
+const int clip_max_vertices = 9; // треугольник после отсечения пятью плоскостями
 
-void SceneManager::rasterize(Model& model)
+// отсечение выпуклого многоугольника плоскостью distance(pos) >= 0 по Сазерленду - Ходжману
+template<typename Distance>
+static int clipPolygon(const ClipVertex* in, int n, ClipVertex* out, Distance distance)
 {
-    auto cam = camers[curr_camera];
-    auto rotation_matrix = model.rotation_matrix;
-    auto objToWorld = model.objToWorld();
-    auto viewMatrix = cam.viewMatrix();
-    auto projMatrix = cam.projectionMatrix;
-
-    for (auto& face: model.faces)
+    int count = 0;
+    for (int i = 0; i < n; i++)
     {
+        auto a = in[i];
+        auto b = in[(i + 1) % n];
+        float da = distance(a.pos), db = distance(b.pos);
+        if (da >= 0.f)
+            out[count++] = a;
+        if ((da >= 0.f) != (db >= 0.f))
+        {
+            float t = da / (da - db);
+            out[count++] = ClipVertex{a.pos + (b.pos - a.pos) * t, a.weight + (b.weight - a.weight) * t};
+        }
+    }
+    return count;
+}
 
-        auto a = vertex_shader->shade(face.a, rotation_matrix, objToWorld, cam);
-        auto b = vertex_shader->shade(face.b, rotation_matrix, objToWorld, cam);
-        auto c = vertex_shader->shade(face.c, rotation_matrix, objToWorld, cam);
+// сборка грани из обработанных вершин кадра с номерами ids: после отбраковки
+// нелицевых граней и граней целиком вне пирамиды видимости грань отсекается
+// в пространстве отсечения ближней плоскостью (z >= 0), а боковыми - только если
+// выходит за защитную полосу, в которой растеризатор справляется сам. Получившийся
+// многоугольник разбивается веером на треугольники, которые добавляются в out.
+// cull - отбрасывать ли нелицевые грани
+void SceneManager::setupFace(RasterBuffers& buffers, const RasterDraw& draw, int face, const int (&ids)[3],
+                             const Mat4x4f& view, const Mat4x4f& projection, const Vec3f& eye, bool cull,
+                             std::vector<RasterTriangle>& out)
+{
+    const auto& world = buffers.vertices.world;
+    if (cull && backfaceCulling(world[ids[0]], world[ids[1]], world[ids[2]], eye))
+        return;
+
+    ClipVertex poly[clip_max_vertices], buffer[clip_max_vertices];
+    for (int i = 0; i < 3; i++)
+        poly[i] = ClipVertex{buffers.vertices.clip[ids[i]], Vec3f{float(i == 0), float(i == 1), float(i == 2)}};
+
+    // плоскости: ближняя, дальняя и боковые по краю защитной полосы
+    auto planes = [&](int plane, const Vec4f& v)
+    {
+        switch (plane)
+        {
+            case 0: return v.z;
+            case 1: return v.w - v.z;
+            case 2: return guard_band * v.w - v.x;
+            case 3: return guard_band * v.w + v.x;
+            case 4: return guard_band * v.w - v.y;
+            default: return guard_band * v.w + v.y;
+        }
+    };
+    // целиком за одной из плоскостей пирамиды видимости
+    auto outside = [&](auto test)
+    {
+        return test(poly[0].pos) && test(poly[1].pos) && test(poly[2].pos);
+    };
+    if (outside([](const Vec4f& v){ return v.x < -v.w; }) || outside([](const Vec4f& v){ return v.x > v.w; }) ||
+        outside([](const Vec4f& v){ return v.y < -v.w; }) || outside([](const Vec4f& v){ return v.y > v.w; }) ||
+        outside([](const Vec4f& v){ return v.z < 0.f; }) || outside([](const Vec4f& v){ return v.z > v.w; }))
+        return;
 
-        if (backfaceCulling(a, b, c))
+    int count = 3;
+    bool clipped_any = false;
+    for (int plane = 0; plane < 6 && count >= 3; plane++)
+    {
+        // дальняя плоскость только отбраковывает, отсечение ею не нужно растеризатору
+        if (plane == 1)
+            continue;
+        bool crosses = false;
+        for (int i = 0; i < count; i++)
+            crosses |= planes(plane, poly[i].pos) < 0.f;
+        if (!crosses)
             continue;
+        count = clipPolygon(poly, count, buffer, [&](const Vec4f& v){ return planes(plane, v); });
+        std::copy(buffer, buffer + count, poly);
+        clipped_any = true;
+    }
+    if (count < 3)
+        return;
 
-        a = geom_shader->shade(a, projMatrix, viewMatrix);
-        b = geom_shader->shade(b, projMatrix, viewMatrix);
-        c = geom_shader->shade(c, projMatrix, viewMatrix);
+    // вершины многоугольника: атрибуты по весам исходных вершин грани
+    Vertex clipped[clip_max_vertices];
+    for (int i = 0; i < count; i++)
+    {
+        if (!clipped_any)
+        {
+            clipped[i] = buffers.vertices.projected[ids[i]];
+            continue;
+        }
+        auto& w = poly[i].weight;
+        auto& a = world[ids[0]], & b = world[ids[1]], & c = world[ids[2]];
+        auto v = a;
+        v.pos = baryCentricInterpolation(a.pos, b.pos, c.pos, w);
+        v.normal = baryCentricInterpolation(a.normal, b.normal, c.normal, w);
+        v.color = baryCentricInterpolation(a.color, b.color, c.color, w);
+        v.u = interPolateCord(a.u, b.u, c.u, w);
+        v.v = interPolateCord(a.v, b.v, c.v, w);
+        clipped[i] = geom_shader.shade(v, projection, view);
+    }
 
-        rasterBarTriangle(a, b, c);
+    RasterTriangle tri;
+    tri.draw = &draw - buffers.draws.data();
+    tri.face = face;
+    std::copy(ids, ids + 3, tri.ids);
+    for (int k = 1; k + 1 < count; k++)
+    {
+        int corners[3] = {0, k, k + 1};
+        for (int i = 0; i < 3; i++)
+        {
+            tri.v[i] = clipped[corners[i]];
+            tri.weight[i] = poly[corners[i]].weight;
+        }
+        if (setupTriangle(tri))
+            out.push_back(tri);
     }
 }
 
-#define Min(val1, val2) std::min(val1, val2)
-#define Max(val1, val2) std::max(val1, val2)
-// заполнение треугольника с использованием барицентрических координат
-void SceneManager::rasterBarTriangle(Vertex p1_, Vertex p2_, Vertex p3_)
+// растровые координаты вершин и рёберные функции в фиксированной точке,
+// задаются один раз на треугольник. false - треугольник не покрывает пикселей
+bool SceneManager::setupTriangle(RasterTriangle& tri)
 {
-    if (!clip(p1_) && !clip(p2_) && !clip(p3_))
-        return;
+    int64_t fx[3], fy[3];
+    for (int i = 0; i < 3; i++)
+    {
+        denormolize(width, height, tri.v[i]);
+        // защитная полоса не даёт выйти за диапазон, кроме вырожденных случаев
+        if (!(fabs(tri.v[i].pos.x) < raster_limit && fabs(tri.v[i].pos.y) < raster_limit))
+            return false;
+        fx[i] = std::lround(tri.v[i].pos.x * (1 << subpixel_bits));
+        fy[i] = std::lround(tri.v[i].pos.y * (1 << subpixel_bits));
+    }
+
+    // обход по часовой стрелке на экране, иначе вершины переставляются
+    int64_t area = (fx[1] - fx[0]) * (fy[2] - fy[0]) - (fy[1] - fy[0]) * (fx[2] - fx[0]);
+    if (area == 0)
+        return false;
+    if (area < 0)
+    {
+        std::swap(tri.v[1], tri.v[2]);
+        std::swap(tri.weight[1], tri.weight[2]);
+        std::swap(fx[1], fx[2]);
+        std::swap(fy[1], fy[2]);
+        area = -area;
+    }
 
-    denormolize(width, height, p1_);
-    denormolize(width, height, p2_);
-    denormolize(width, height, p3_);
+    // функция ребра напротив вершины i даёт её барицентрическую координату
+    tri.edges[0] = EdgeFunction(fx[1], fy[1], fx[2], fy[2]);
+    tri.edges[1] = EdgeFunction(fx[2], fy[2], fx[0], fy[0]);
+    tri.edges[2] = EdgeFunction(fx[0], fy[0], fx[1], fy[1]);
+    tri.inv_area = 1.f / float(area);
+
+    float z[3] = {tri.v[0].pos.z, tri.v[1].pos.z, tri.v[2].pos.z};
+    tri.zmin = std::min({z[0], z[1], z[2]});
+    tri.zmax = std::max({z[0], z[1], z[2]});
+    tri.margin = depth_eps + 1e-5f * std::max(fabs(tri.zmin), fabs(tri.zmax));
+    tri.z0 = tri.dzdx = tri.dzdy = 0.0;
+    for (int i = 0; i < 3; i++)
+    {
+        double w = double(z[i]) / double(area);
+        tri.z0 += w * double(tri.edges[i].c + tri.edges[i].bias);
+        tri.dzdx += w * double(tri.edges[i].a);
+        tri.dzdy += w * double(tri.edges[i].b);
+    }
 
-    auto p1 = p1_.pos;
-    auto p2 = p2_.pos;
-    auto p3 = p3_.pos;
+    const int one = 1 << subpixel_bits;
+    tri.sx = std::max(0, int((Min(Min(fx[0], fx[1]), fx[2]) + one - 1) >> subpixel_bits));
+    tri.ex = std::min(width - 1, int(Max(Max(fx[0], fx[1]), fx[2]) >> subpixel_bits));
+    tri.sy = std::max(0, int((Min(Min(fy[0], fy[1]), fy[2]) + one - 1) >> subpixel_bits));
+    tri.ey = std::min(height - 1, int(Max(Max(fy[0], fy[1]), fy[2]) >> subpixel_bits));
+    return tri.sx <= tri.ex && tri.sy <= tri.ey;
+}
 
-    float sx = std::floor(Min(Min(p1.x, p2.x), p3.x));
-    float ex = std::ceil(Max(Max(p1.x, p2.x), p3.x));
+// заполнение части треугольника внутри тайла [x0, x1] x [y0, y1]: рёберные функции
+// на каждом пикселе только наращиваются. Тайл обходится блоками буфера глубины;
+// блок вне треугольника или заведомо закрытый (по Hi-Z) пропускается целиком,
+// в целиком внутреннем не проверяется покрытие, а если треугольник там заведомо
+// ближе всего нарисованного - и глубина. Прошедший тест глубины пиксель получает
+// fragment(x, y, bary). true - записан хотя бы один пиксель
+template<typename Fragment>
+bool SceneManager::rasterTriangle(DepthBuffer& depth, const RasterTriangle& tri, int x0, int y0, int x1, int y1,
+                                  Fragment fragment)
+{
+    int sx = std::max(tri.sx, x0), ex = std::min(tri.ex, x1);
+    int sy = std::max(tri.sy, y0), ey = std::min(tri.ey, y1);
 
-    float sy = std::floor(Min(Min(p1.y, p2.y), p3.y));
-    float ey = std::ceil(Max(Max(p1.y, p2.y), p3.y));
+    auto& edges = tri.edges;
+    auto& v = tri.v;
+    float z[3] = {v[0].pos.z, v[1].pos.z, v[2].pos.z};
+    bool written = false;
 
-    for (int y = static_cast<int>(sy); y < static_cast<int>(ey); y++)
+    for (int by = sy & ~(raster_block - 1); by <= ey; by += raster_block)
     {
-        for (int x = static_cast<int>(sx); x < static_cast<int>(ex); x++)
+        int ys = std::max(by, sy), ye = std::min(by + raster_block - 1, ey);
+        for (int bx = sx & ~(raster_block - 1); bx <= ex; bx += raster_block)
         {
-            Vec3f bary = toBarycentric(p1, p2, p3, Vec3f(static_cast<float>(x), static_cast<float>(y)));
-            if ( (bary.x > 0.0f || fabs(bary.x) < eps) && (bary.x < 1.0f || fabs(bary.x - 1.0f) < eps) &&
-                 (bary.y > 0.0f || fabs(bary.y) < eps) && (bary.y < 1.0f || fabs(bary.y - 1.0f) < eps) &&
-                 (bary.z > 0.0f || fabs(bary.z) < eps) && (bary.z < 1.0f || fabs(bary.z - 1.0f) < eps))
+            int xs = std::max(bx, sx), xe = std::min(bx + raster_block - 1, ex);
+            bool inside = true;
+            bool outside = false;
+            for (auto& e: edges)
+            {
+                outside |= e.maxIn(xs, ys, xe, ye) < 0;
+                inside &= e.minIn(xs, ys, xe, ye) >= 0;
+            }
+            if (outside)
+                continue;
+
+            // глубина треугольника в блоке - по плоскости в углах блока
+            double zx0 = tri.dzdx * xs, zx1 = tri.dzdx * xe, zy0 = tri.dzdy * ys, zy1 = tri.dzdy * ye;
+            float z_near = std::max(tri.zmin, float(tri.z0 + std::min(zx0, zx1) + std::min(zy0, zy1))) - tri.margin;
+            float z_far = std::min(tri.zmax, float(tri.z0 + std::max(zx0, zx1) + std::max(zy0, zy1))) + tri.margin;
+            int block_x = bx / raster_block, block_y = by / raster_block;
+            if (z_near > depth.blockMax(block_x, block_y) + depth_eps)
+                continue;
+            bool front = inside && z_far < depth.blockMin(block_x, block_y) - depth_eps;
+
+            float* zb = depth.block(block_x, block_y);
+            bool block_written = false;
+            int64_t row[3] = {edges[0].at(xs, ys), edges[1].at(xs, ys), edges[2].at(xs, ys)};
+            for (int y = ys; y <= ye; y++)
             {
-                auto interpolated = baryCentricInterpolation(p1, p2, p3, bary);
-                interpolated.x = x;
-                interpolated.y = y;
-                if (testAndSet(interpolated)){
-                    auto pixel_color = pixel_shader->shade(p1_, p2_, p3_, bary) * 255.f;
-                    img.setPixelColor(x, y, qRgb(pixel_color.x, pixel_color.y, pixel_color.z));
+                int64_t e[3] = {row[0], row[1], row[2]};
+                float* zrow = zb + (y - by) * raster_block - bx;
+                for (int x = xs; x <= xe; x++)
+                {
+                    if (inside || (e[0] | e[1] | e[2]) >= 0)
+                    {
+                        auto bary = tri.bary(e);
+                        float pz = interPolateCord(z[0], z[1], z[2], bary);
+                        bool visible = front ? (zrow[x] = pz, true) : DepthBuffer::testAndSet(zrow[x], pz);
+                        if (visible)
+                        {
+                            fragment(x, y, bary);
+                            block_written = true;
+                        }
+                    }
+                    e[0] += edges[0].a;
+                    e[1] += edges[1].a;
+                    e[2] += edges[2].a;
                 }
+                row[0] += edges[0].b;
+                row[1] += edges[1].b;
+                row[2] += edges[2].b;
+            }
+            if (block_written)
+            {
+                depth.updateBlock(block_x, block_y);
+                written = true;
             }
         }
     }
+    return written;
+}
 
+// затенение отрезка строки [xs, xe) пикселей одного треугольника: рёберные функции
+// только наращиваются, как при растеризации
+template<typename PixelShader>
+static void shadeSpan(const RasterTriangle& tri, const PixelShader& shader, int xs, int xe, int y, QRgb* row)
+{
+    auto& edges = tri.edges;
+    int64_t e[3] = {edges[0].at(xs, y), edges[1].at(xs, y), edges[2].at(xs, y)};
+    for (int x = xs; x < xe; x++)
+    {
+        row[x] = shadeFragment(tri, shader, tri.bary(e));
+        e[0] += edges[0].a;
+        e[1] += edges[1].a;
+        e[2] += edges[2].a;
+    }
 }
 
-bool SceneManager::testAndSet(const Vec3f& p)
+// отложенное затенение тайла [x0, x1] x [y0, y1]: каждый видимый пиксель затеняется
+// один раз, барицентрические координаты восстанавливаются по рёберным функциям его
+// треугольника точно такими же, какими были при растеризации. Соседние пиксели
+// одного треугольника затеняются отрезком с одним выбором шейдера
+void SceneManager::shadeVisible(const RasterBuffers& buffers, int x0, int y0, int x1, int y1, QRgb* pixels, int stride)
 {
-    int x = std::round(p.x), y = std::round(p.y);
-    if (x >= width || y >= height || x < 0 || y < 0)
-        return false;
-    if (p.z < depthBuffer[x][y] || fabs(p.z - depthBuffer[x][y]) < eps)
+    for (int y = y0; y <= y1; y++)
     {
-        depthBuffer[x][y] = p.z;
-        return true;
+        const RasterTriangle* const* visible = &buffers.visibility[y * width];
+        QRgb* row = pixels + y * stride;
+        for (int x = x0; x <= x1;)
+        {
+            auto tri = visible[x];
+            int end = x + 1;
+            while (end <= x1 && visible[end] == tri)
+                end++;
+            if (tri)
+            {
+                auto& draw = buffers.draws[tri->draw];
+                if (draw.shading == PixelShading::texture)
+                    shadeSpan(*tri, TextureShader(draw.model->texture), x, end, y, row);
+                else
+                    shadeSpan(*tri, ColorShader(), x, end, y, row);
+            }
+            x = end;
+        }
     }
-    return false;
 }
 
+// буфер видимости для гибридного режима тем же конвейером, что и предпросмотр, на
+// потоках RasterPool: в тайле сначала ближайший треугольник каждого пикселя, затем для
+// видимых пикселей перспективно-корректные веса вершин грани и точка попадания
+void SceneManager::rasterizeVisibility(const SceneSnapshot& snap, GBuffer& buffer)
+{
+    const auto& cam = snap.camera;
+    auto& buffers = visibility_raster;
+    RasterStats stats;
+    setupPass(buffers, snap.models, cam, true, stats);
+
+    buffers.visibility.resize(width * height);
+    const auto& world = buffers.vertices.world;
+    buffers.pool->forEach(buffers.tiles, [&](int tile)
+    {
+        int x0 = (tile % buffers.tiles_x) * raster_tile, y0 = (tile / buffers.tiles_x) * raster_tile;
+        int x1 = std::min(x0 + raster_tile, width) - 1, y1 = std::min(y0 + raster_tile, height) - 1;
+        for (int y = y0; y <= y1; y++)
+            std::fill_n(&buffers.visibility[y * width + x0], x1 - x0 + 1, nullptr);
+        drawTile(buffers, tile, [&](const RasterTriangle& tri)
+        {
+            return rasterTriangle(buffers.depth, tri, x0, y0, x1, y1, [&](int x, int y, const Vec3f&)
+            {
+                buffers.visibility[y * width + x] = &tri;
+            });
+        });
+
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                auto& texel = buffer.texels[y * width + x];
+                auto tri = buffers.visibility[y * width + x];
+                if (!tri)
+                {
+                    texel = GBufferTexel();
+                    continue;
+                }
+                // покрытие решили рёберные функции, а веса считаются по неокруглённым экранным
+                // координатам вершин: округление до подпикселя сдвигает точку попадания заметно
+                // для луча, особенно на поверхностях, видимых под острым углом
+                auto& v = tri->v;
+                auto bary = toBarycentric(v[0].pos, v[1].pos, v[2].pos, Vec3f(float(x), float(y)));
+                // 1/w линейна в экранных координатах
+                float p[3] = {bary.x * v[0].invW, bary.y * v[1].invW, bary.z * v[2].invW};
+                auto weight = (tri->weight[0] * p[0] + tri->weight[1] * p[1] + tri->weight[2] * p[2]) *
+                              (1.f / (p[0] + p[1] + p[2]));
+                auto& a = world[tri->ids[0]], & b = world[tri->ids[1]], & c = world[tri->ids[2]];
+                texel.model = buffers.draws[tri->draw].index;
+                texel.face = tri->face;
+                texel.bary = weight;
+                texel.point = baryCentricInterpolation(a.pos, b.pos, c.pos, weight);
+                texel.normal = baryCentricInterpolation(a.normal, b.normal, c.normal, weight).normalize();
+                texel.t = (texel.point - cam.position).len();
+            }
+        }
+    });
+    buffer.approximate = true;
+}
 
 void SceneManager::showTracedResult()
 {
-    for (auto& th: threads)
+    if (current_frame)
     {
-        th->wait();
-        delete th;
+        // кадры предпросмотра, захваченные раньше, уже устарели
+        preview_epoch++;
+        this->show(current_frame->image);
+        traced_shown = true;
     }
-    threads.clear();
-    this->show();
 }
 
-void SceneManager::show()
+void SceneManager::show(const QImage& image)
 {
     scene->clear();
-    scene->addPixmap(QPixmap::fromImage(img));
+    scene->addPixmap(QPixmap::fromImage(image));
+}
+
+Model* SceneManager::edit(int index)
+{
+    shading_version++;
+    object_version++;
+    return editIntensity(index);
+}
+
+// изменение, после которого трассированное изображение можно пересобрать
+// из вкладов источников (только интенсивность источника света)
+Model* SceneManager::editIntensity(int index)
+{
+    auto& model = models[index];
+    // модель ещё используется опубликованным снимком - изменяем копию
+    if (model.use_count() > 1)
+        model = model->clone();
+    scene_version++;
+    content_version++;
+    return model.get();
+}
+
+SnapshotPtr SceneManager::snapshot()
+{
+    if (published && published->version == scene_version)
+        return published;
+
+    auto snap = std::make_shared<SceneSnapshot>(camers[curr_camera], scene_version, geometry_version, shading_version,
+                                              content_version, object_version);
+    snap->models.reserve(models.size());
+    for (auto& model: models)
+    {
+        // неактуальная оболочка бывает только у изменённой (уже скопированной) модели
+        if (model->isObject() && !model->box_valid)
+            model->genBox();
+        snap->models.push_back(model);
+    }
+    // при движении камеры содержимое не меняется, и массивы сцены переиспользуются
+    if (published && published->content_version == content_version)
+    {
+        snap->flat = published->flat;
+        snap->lights = published->lights;
+    }
+    else
+    {
+        // после изменения только интенсивностей источников объекты прежние,
+        // и заново строятся лишь данные источников
+        if (published && published->object_version == object_version)
+            snap->flat = published->flat;
+        else
+            snap->flat = std::make_shared<FlatScene>(snap->models);
+        snap->lights = std::make_shared<LightTree>(snap->models);
+    }
+    published = snap;
+    return published;
 }
 
 float check_shift(float curr, float target)
@@ -191,16 +775,18 @@ void SceneManager::shift(trans_type t, float val)
     switch (t)
     {
         case shift_x:
-            models[current_model]->shiftX(val);
+            edit()->shiftX(val);
             break;
         case shift_y:
-            models[current_model]->shiftY(val);
+            edit()->shiftY(val);
             break;
         case shift_z:
-            models[current_model]->shiftZ(val);
+            edit()->shiftZ(val);
     }
+    if (models[current_model]->isObject())
+        geometry_version++;
 
-    render_all();
+    requestPreview();
 }
 
 void SceneManager::rotate(trans_type t, float angle)
@@ -208,16 +794,18 @@ void SceneManager::rotate(trans_type t, float angle)
     switch (t)
     {
         case rot_x:
-            models[current_model]->rotateX(angle);
+            edit()->rotateX(angle);
             break;
         case rot_y:
-            models[current_model]->rotateY(angle);
+            edit()->rotateY(angle);
             break;
         case rot_z:
-            models[current_model]->rotateZ(angle);
+            edit()->rotateZ(angle);
     }
+    if (models[current_model]->isObject())
+        geometry_version++;
 
-    render_all();
+    requestPreview();
 }
 
 void SceneManager::scale(trans_type t, float factor)
@@ -225,16 +813,18 @@ void SceneManager::scale(trans_type t, float factor)
     switch (t)
     {
         case scale_x:
-            models[current_model]->scaleX(factor);
+            edit()->scaleX(factor);
             break;
         case scale_y:
-            models[current_model]->scaleY(factor);
+            edit()->scaleY(factor);
             break;
         case scale_z:
-            models[current_model]->scaleZ(factor);
+            edit()->scaleZ(factor);
     }
+    if (models[current_model]->isObject())
+        geometry_version++;
 
-    render_all();
+    requestPreview();
 }
 
 void SceneManager::moveCamera(trans_type t, float dist)
@@ -284,8 +874,13 @@ void SceneManager::moveCamera(trans_type t, float dist)
     }
 
     change_func();
+    scene_version++;
+    geometry_version++;
+    shading_version++;
 
-    render_all();
+    // при перепроецировании кадр сразу трассируется, предпросмотр только мешал бы
+    if (!trace_settings.temporal || trace_settings.mode == path_tracing)
+        requestPreview();
 }
 
 const int cube_n = 512, other_n = 20, pyramid_n = 512;
@@ -315,9 +910,14 @@ void SceneManager::uploadModel(std::string name, uint32_t& uid)
         return;
 
     uid = models_index++;
-    models.push_back(new Model(files.at(name), uid, n_power.at(name)));
-
-    render_all();
+    models.push_back(std::make_shared<Model>(files.at(name), uid, n_power.at(name)));
+    scene_version++;
+    geometry_version++;
+    shading_version++;
+    content_version++;
+    object_version++;
+
+    requestPreview();
 }
 
 void SceneManager::uploadLight(std::string name, uint32_t &uid)
@@ -334,22 +934,32 @@ void SceneManager::uploadLight(std::string name, uint32_t &uid)
     uid = models_index++;
     if (name == "Точечный источник")
     {
-        models.push_back(new Light(Light::light_type::point, {1.f, 1.f, 1.f}, pointLightPosition,
-                                   1, {0.f, 0.f, 0.f}, files.at(name), uid, {0.2f, 0.2f, 0.2f}));
+        models.push_back(std::make_shared<Light>(Light::light_type::point, Vec3f{1.f, 1.f, 1.f}, pointLightPosition,
+                                                 1, Vec3f{0.f, 0.f, 0.f}, files.at(name), uid, Vec3f{0.2f, 0.2f, 0.2f}));
     } else if (name == "Направленный")
     {
-        models.push_back(new Light(Light::light_type::directional, {1.f, 1.f, 1.f}, directionLightPosition,
-                                   1, {0.f, 0.f, -1.f}, files.at(name), uid));
+        models.push_back(std::make_shared<Light>(Light::light_type::directional, Vec3f{1.f, 1.f, 1.f}, directionLightPosition,
+                                                 1, Vec3f{0.f, 0.f, -1.f}, files.at(name), uid));
     }
+    scene_version++;
+    geometry_version++;
+    shading_version++;
+    content_version++;
+    object_version++;
 
-    render_all();
+    requestPreview();
 }
 
 
 void SceneManager::removeModel()
 {
     models.erase(models.begin() + current_model);
-    render_all();
+    scene_version++;
+    geometry_version++;
+    shading_version++;
+    content_version++;
+    object_version++;
+    requestPreview();
 }
 
 void SceneManager::setCurrentModel(uint32_t uid)
@@ -364,63 +974,115 @@ void SceneManager::setCurrentModel(uint32_t uid)
 
 void SceneManager::setColor(const Vec3f &color)
 {
-    models[current_model]->setColor(color);
-    render_all();
+    edit()->setColor(color);
+    requestPreview();
 }
 
 void SceneManager::setTexture(const QImage &img)
 {
-    models[current_model]->has_texture = true;
-    models[current_model]->setColor(Vec3f{1.f, 1.f, 1.f});
-    models[current_model]->texture = img;
-    render_all();
+    auto model = edit();
+    model->has_texture = true;
+    model->setColor(Vec3f{1.f, 1.f, 1.f});
+    // растеризатор читает текселы напрямую
+    model->texture = img.convertToFormat(QImage::Format_ARGB32);
+    requestPreview();
 }
 
 void SceneManager::setFlagTexture(bool flag, const Vec3f& color)
 {
-    models[current_model]->has_texture = flag;
-    models[current_model]->setColor(color);
-    render_all();
+    auto model = edit();
+    model->has_texture = flag;
+    model->setColor(color);
+    requestPreview();
 }
 
 void SceneManager::setSpecular(float val)
 {
-    models[current_model]->specular = val;
-    render_all();
+    edit()->specular = val;
+    requestPreview();
 }
 
 void SceneManager::setReflective(float val)
 {
-    models[current_model]->reflective = val;
-    render_all();
+    edit()->reflective = val;
+    requestPreview();
 }
 
 void SceneManager::setRefraction(float refract)
 {
-    models[current_model]->refractive = refract;
-    render_all();
+    edit()->refractive = refract;
+    requestPreview();
 }
 
-void SceneManager::setIntensity(float intens)
+// после изменения интенсивности: трассированное изображение пересчитывается по кэшу,
+// предпросмотр рисуется заново. Трассированное изображение, которое по кэшу не
+// пересчитать, остаётся до перетрассировки - её запускает вызывающий по false
+bool SceneManager::updateIntensity()
 {
-    Light* l = dynamic_cast<Light*>(models[current_model]);
+    if (relight())
+        return true;
+    if (traced_shown)
+        return false;
+    requestPreview();
+    return true;
+}
+
+bool SceneManager::setIntensity(float intens)
+{
+    Light* l = dynamic_cast<Light*>(editIntensity(current_model));
     l->color_intensity.x = intens;
     l->color_intensity.y = intens;
     l->color_intensity.z = intens;
-    render_all();
+    return updateIntensity();
 }
 
-void SceneManager::setAmbIntensity(float intensity)
+bool SceneManager::setAmbIntensity(float intensity)
 {
-    for (auto& model: models)
+    for (size_t i = 0; i < models.size(); i++)
     {
-        if (model->isObject()) continue;
-        Light* l = dynamic_cast<Light*>(model);
+        if (models[i]->isObject()) continue;
+        Light* l = dynamic_cast<Light*>(models[i].get());
         if (l->t == Light::light_type::ambient)
         {
+            l = dynamic_cast<Light*>(editIntensity(i));
             l->color_intensity.x = intensity;
             l->color_intensity.y = intensity;
             l->color_intensity.z = intensity;
         }
     }
+    return updateIntensity();
+}
+
+void SceneManager::setAntialiasing(bool enabled, int max_samples, float threshold)
+{
+    trace_settings.adaptive_aa = enabled;
+    trace_settings.aa_max_samples = max_samples;
+    trace_settings.aa_threshold = threshold;
+}
+
+void SceneManager::setTraceMode(trace_mode mode)
+{
+    trace_settings.mode = mode;
+    accum.reset();
+}
+
+void SceneManager::setDenoise(bool enabled)
+{
+    trace_settings.denoise = enabled;
+}
+
+void SceneManager::setTemporal(bool enabled)
+{
+    trace_settings.temporal = enabled;
+}
+
+void SceneManager::setTimeBudget(int milliseconds)
+{
+    trace_settings.budget_ms = milliseconds;
+}
+
+void SceneManager::setDeferredShading(bool enabled)
+{
+    deferred_shading = enabled;
+    requestPreview();
 }
@@ -2,6 +2,8 @@
 #include "OBJ_Loader.h"
 #include "bary.h"
 #include <QtDebug>
+#include <map>
+#include <array>
 
 const float eps_intersect = std::numeric_limits<float>::epsilon();
 
@@ -46,41 +48,56 @@ Model::Model(const std::string& fileName, uint32_t uid_,  int n_, const Vec3f& s
     bool l = loader.LoadFile(fileName);
     qDebug() <<"mean = " << l;
     color = {0.5, 0.5, 0.5};
+    auto geometry = std::make_shared<Mesh>();
+    // загрузчик заводит свои вершины для каждой грани OBJ, поэтому совпадающие вершины
+    // склеиваются: общая вершина соседних треугольников обрабатывается один раз за кадр
+    std::map<std::array<float, 8>, uint32_t> unique;
     for (int i = 0; i < loader.LoadedMeshes.size(); ++i)
     {
         objl::Mesh curMesh = loader.LoadedMeshes[i];
+        // индексы сетки отсчитываются от её первой вершины
+        std::vector<uint32_t> remap(curMesh.Vertices.size());
         for (int j = 0; j < curMesh.Vertices.size(); j++)
         {
-            vertex_buffer.push_back(Vertex{
-                                   Vec3f{curMesh.Vertices[j].Position.X , curMesh.Vertices[j].Position.Y, curMesh.Vertices[j].Position.Z},
-                                   Vec3f{curMesh.Vertices[j].Normal.X,  curMesh.Vertices[j].Normal.Y, curMesh.Vertices[j].Normal.Z},
-                                   curMesh.Vertices[j].TextureCoordinate.X, curMesh.Vertices[j].TextureCoordinate.Y,
-                                   color
-                               });
+            auto& v = curMesh.Vertices[j];
+            std::array<float, 8> key = {v.Position.X, v.Position.Y, v.Position.Z, v.Normal.X, v.Normal.Y, v.Normal.Z,
+                                        v.TextureCoordinate.X, v.TextureCoordinate.Y};
+            auto it = unique.emplace(key, uint32_t(geometry->vertex_buffer.size()));
+            if (it.second)
+                geometry->vertex_buffer.push_back(Vertex{
+                                       Vec3f{v.Position.X, v.Position.Y, v.Position.Z},
+                                       Vec3f{v.Normal.X, v.Normal.Y, v.Normal.Z},
+                                       v.TextureCoordinate.X, v.TextureCoordinate.Y,
+                                       color
+                                   });
+            remap[j] = it.first->second;
         }
 
         for (int j = 0; j < curMesh.Indices.size(); j++ )
-            index_buffer.push_back(curMesh.Indices[j]);
+            geometry->index_buffer.push_back(remap[curMesh.Indices[j]]);
     }
 
     // create faces
-    for (int i = 0; i < this->index_buffer.size() / 3; i++)
+    for (int i = 0; i < geometry->index_buffer.size() / 3; i++)
     {
-        faces.push_back
+        geometry->faces.push_back
         (
             {
-                    this->vertex_buffer[this->index_buffer[3 * i]],
-                    this->vertex_buffer[this->index_buffer[3 * i + 1]],
-                    this->vertex_buffer[this->index_buffer[3 * i + 2]]
+                    geometry->vertex_buffer[geometry->index_buffer[3 * i]],
+                    geometry->vertex_buffer[geometry->index_buffer[3 * i + 1]],
+                    geometry->vertex_buffer[geometry->index_buffer[3 * i + 2]]
 
             }
         );
-        auto& f = faces.back();
+        auto& f = geometry->faces.back();
         f.normal = Vec3f::cross(f.b.pos - f.a.pos, f.c.pos - f.a.pos);
     }
+    geometry->buildMeshlets();
+    mesh = geometry;
 
-    qDebug() << "size = " << faces.size();
+    qDebug() << "size = " << geometry->faces.size();
     texture.load("C:\\Users\\gimna\\Desktop\\BMSTU\\KG\\Praktika\\Frolov\\programm\\textures\\bricks.jpg");
+    texture = texture.convertToFormat(QImage::Format_ARGB32);
     scale_x = scale.x;
     scale_y = scale.y;
     scale_z = scale.z;
@@ -93,6 +110,140 @@ Model::Model(const std::string& fileName, uint32_t uid_,  int n_, const Vec3f& s
 
 }
 
+// Разбиение на кластеры: кластер растёт от первого свободного треугольника по соседям
+// с общими точками, пока в нём есть место для треугольников и вершин. Затем
+// треугольники модели переставляются так, чтобы каждый кластер шёл подряд
+void Mesh::buildMeshlets()
+{
+    size_t count = index_buffer.size() / 3;
+    // соседство по положению: вершины граней с разными нормалями не склеены
+    std::map<std::array<float, 3>, uint32_t> points;
+    std::vector<uint32_t> point(vertex_buffer.size());
+    for (size_t i = 0; i < vertex_buffer.size(); i++)
+    {
+        auto& p = vertex_buffer[i].pos;
+        point[i] = points.emplace(std::array<float, 3>{p.x, p.y, p.z}, uint32_t(points.size())).first->second;
+    }
+    std::vector<std::vector<uint32_t>> around(points.size());
+    for (size_t t = 0; t < count; t++)
+        for (int k = 0; k < 3; k++)
+            around[point[index_buffer[3 * t + k]]].push_back(t);
+
+    // единичные нормали граней, у вырожденных - нулевые
+    std::vector<Vec3f> normals(count);
+    for (size_t t = 0; t < count; t++)
+    {
+        const uint32_t* tri = &index_buffer[3 * t];
+        auto& a = vertex_buffer[tri[0]].pos;
+        auto n = Vec3f::cross(vertex_buffer[tri[1]].pos - a, vertex_buffer[tri[2]].pos - a);
+        normals[t] = n.len() > 0.f ? n / n.len() : n;
+    }
+
+    std::vector<bool> used(count, false);
+    std::vector<int> local(vertex_buffer.size(), -1);
+    std::vector<uint32_t> order, candidates;
+    order.reserve(count);
+    size_t seed = 0;
+    while (order.size() < count)
+    {
+        while (used[seed])
+            seed++;
+        Meshlet m;
+        m.first = order.size();
+        m.vertex_first = meshlet_vertices.size();
+        m.vertex_count = 0;
+        Vec3f sum = {0.f, 0.f, 0.f};
+        candidates.assign(1, seed);
+        while (int(order.size()) - m.first < meshlet_max_triangles)
+        {
+            // из соседей берётся грань, ближе всех по нормали к кластеру (узкий конус
+            // нормалей отбрасывает чаще) с поправкой на число новых вершин
+            auto axis = sum.normalize();
+            int best = -1;
+            float best_score = -std::numeric_limits<float>::infinity();
+            size_t kept = 0;
+            for (size_t i = 0; i < candidates.size(); i++)
+            {
+                uint32_t t = candidates[i];
+                if (used[t])
+                    continue;
+                candidates[kept++] = t;
+                const uint32_t* tri = &index_buffer[3 * t];
+                int added = 0;
+                for (int k = 0; k < 3; k++)
+                    added += local[tri[k]] < 0 && (k == 0 || tri[k] != tri[0]) && (k < 2 || tri[k] != tri[1]);
+                // не помещается - станет затравкой одного из следующих кластеров
+                if (m.vertex_count + added > meshlet_max_vertices)
+                    continue;
+                float score = Vec3f::dot(normals[t], axis) - 0.25f * added;
+                if (score > best_score)
+                {
+                    best = kept - 1;
+                    best_score = score;
+                }
+            }
+            candidates.resize(kept);
+            if (best < 0)
+                break;
+            uint32_t t = candidates[best];
+            candidates[best] = candidates.back();
+            candidates.pop_back();
+
+            used[t] = true;
+            order.push_back(t);
+            sum += normals[t];
+            const uint32_t* tri = &index_buffer[3 * t];
+            for (int k = 0; k < 3; k++)
+            {
+                if (local[tri[k]] < 0)
+                {
+                    local[tri[k]] = m.vertex_count++;
+                    meshlet_vertices.push_back(tri[k]);
+                }
+                meshlet_indices.push_back(local[tri[k]]);
+                for (auto n: around[point[tri[k]]])
+                    if (!used[n])
+                        candidates.push_back(n);
+            }
+        }
+        m.count = int(order.size()) - m.first;
+
+        // сфера - вокруг центра ограничивающего параллелепипеда вершин
+        float inf = std::numeric_limits<float>::infinity();
+        Vec3f lo = {inf, inf, inf}, hi = {-inf, -inf, -inf};
+        for (int i = m.vertex_first; i < m.vertex_first + m.vertex_count; i++)
+        {
+            auto& p = vertex_buffer[meshlet_vertices[i]].pos;
+            lo = {std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z)};
+            hi = {std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z)};
+            local[meshlet_vertices[i]] = -1;
+        }
+        m.center = (lo + hi) * 0.5f;
+        m.radius = 0.f;
+        for (int i = m.vertex_first; i < m.vertex_first + m.vertex_count; i++)
+            m.radius = std::max(m.radius, (vertex_buffer[meshlet_vertices[i]].pos - m.center).len());
+
+        // конус нормалей; вырожденные грани не рисуются и в нём не учитываются
+        m.axis = sum.normalize();
+        m.cone_cos = sum.len() < 1e-3f ? -1.f : 1.f;
+        for (int i = m.first; i < m.first + m.count; i++)
+            if (normals[order[i]].len() > 0.f)
+                m.cone_cos = std::min(m.cone_cos, Vec3f::dot(normals[order[i]], m.axis));
+        m.cone_sin = std::sqrt(std::max(0.f, 1.f - m.cone_cos * m.cone_cos));
+        meshlets.push_back(m);
+    }
+
+    std::vector<uint32_t> indices(index_buffer.size());
+    std::vector<Face> sorted(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        std::copy_n(&index_buffer[3 * order[i]], 3, &indices[3 * i]);
+        sorted[i] = faces[order[i]];
+    }
+    index_buffer.swap(indices);
+    faces.swap(sorted);
+}
+
 Vertex transform_position(const Vertex& v, const Mat4x4f& objToWorld, const Mat4x4f& rotationMatrix)
 {
     Vec4f res(v.pos);
@@ -105,7 +256,7 @@ Vertex transform_position(const Vertex& v, const Mat4x4f& objToWorld, const Mat4
     return out;
 }
 
-bool Model::triangleIntersect(const Face& face, const Ray &ray, const Mat4x4f &objToWorld, const Mat4x4f &rotMatrix, InterSectionData &data)
+bool Model::triangleIntersect(const Face& face, const Ray &ray, const Mat4x4f &objToWorld, const Mat4x4f &rotMatrix, InterSectionData &data) const
 {
     auto p0 = transform_position(face.a, objToWorld, rotMatrix);
     auto p1 = transform_position(face.b, objToWorld, rotMatrix);
@@ -145,36 +296,37 @@ bool Model::triangleIntersect(const Face& face, const Ray &ray, const Mat4x4f &o
         data.point = ray.origin + ray.direction * t;
         data.normal = baryCentricInterpolation(p0.normal, p1.normal, p2.normal, bary).normalize();
         data.t = t;
+        data.bary = bary;
         intersected = true;
-        if (this->has_texture)
-        {
-            float pixel_u = interPolateCord(p0.u , p1.u, p2.u, bary);
-            float pixel_v = interPolateCord(p0.v, p1.v, p2.v, bary);
-
-            int x = std::floor(pixel_u * (texture.width()) - 1);
-            int y = std::floor(pixel_v * (texture.height() - 1));
-
-            if (x < 0) x = 0;
-            if (y < 0) y = 0;
-
-            auto color = texture.pixelColor(x, y);
-            auto red = (float)color.red();
-            auto green = (float)color.green();
-            auto blue = (float)color.blue();
-            data.color = Vec3f{red / 255.f,
-                    green/ 255.f ,
-                    blue /255.f};
-
-        }
-        else
-        {
-            data.color = baryCentricInterpolation(p0.color, p1.color, p2.color, bary);
-        }
     }
     return intersected;
 }
 
-bool Model::intersect(const Ray &ray, InterSectionData &data)
+Vec3f Model::surfaceColor(const Face& face, const Vec3f& bary) const
+{
+    if (this->has_texture)
+    {
+        float pixel_u = interPolateCord(face.a.u , face.b.u, face.c.u, bary);
+        float pixel_v = interPolateCord(face.a.v, face.b.v, face.c.v, bary);
+
+        int x = std::floor(pixel_u * (texture.width()) - 1);
+        int y = std::floor(pixel_v * (texture.height() - 1));
+
+        if (x < 0) x = 0;
+        if (y < 0) y = 0;
+
+        auto color = texture.pixelColor(x, y);
+        auto red = (float)color.red();
+        auto green = (float)color.green();
+        auto blue = (float)color.blue();
+        return Vec3f{red / 255.f,
+                green/ 255.f ,
+                blue /255.f};
+    }
+    return baryCentricInterpolation(face.a.color, face.b.color, face.c.color, bary);
+}
+
+bool Model::intersect(const Ray &ray, InterSectionData &data) const
 {
 
     if (!this->box.intersect(ray))
@@ -187,16 +339,22 @@ bool Model::intersect(const Ray &ray, InterSectionData &data)
     auto objToWorld = this->objToWorld();
     auto rotMatrix = this->rotation_matrix;
     InterSectionData d;
-    for (auto& face: faces)
+    auto& faces = mesh->faces;
+    for (size_t i = 0; i < faces.size(); i++)
     {
-        if (triangleIntersect(face, ray, objToWorld, rotMatrix, d) && d.t < model_dist)
+        if (triangleIntersect(faces[i], ray, objToWorld, rotMatrix, d) && d.t < model_dist)
         {
             model_dist = d.t;
             data = d;
+            data.face = i;
             intersected = true;
         }
     }
 
+    // цвет нужен только для ближайшего треугольника
+    if (intersected)
+        data.color = surfaceColor(faces[data.face], data.bary);
+
     return intersected;
 }
 
@@ -207,7 +365,7 @@ void Model::genBox()
     Vec3f min = {inf, inf, inf};
     Vec3f max = {-inf, -inf, -inf};
 
-    for (auto &v : vertex_buffer)
+    for (auto &v : mesh->vertex_buffer)
     {
         Vec4f tmp(v.pos);
         tmp = tmp * this->objToWorld();
@@ -227,6 +385,7 @@ void Model::genBox()
     }
 
     this->box = BoundingBox(min, max);
+    this->box_valid = true;
 
 }
 
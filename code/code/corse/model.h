@@ -22,6 +22,51 @@ struct Face
     Vec3f normal;
 };
 
+const int meshlet_max_triangles = 64; // треугольников в кластере, не больше
+const int meshlet_max_vertices = 128; // вершин в кластере, не больше (локальный номер - байт)
+
+// Кластер соседних треугольников модели, отбрасываемый целиком: по ограничивающей
+// сфере - вне пирамиды видимости, по конусу нормалей - если все его грани нелицевые.
+// Треугольники кластера в модели идут подряд
+struct Meshlet
+{
+    // все грани нелицевые для камеры в точке eye (в координатах модели), как
+    // в SceneManager::backfaceCulling. side = -1, если преобразование модели
+    // меняет ориентацию граней. Для грани кластера dot(n, p - eye) не меньше
+    // |v| * cos(угол(ось, v) + раствор) - radius, где v - от камеры к центру сферы
+    bool backfacing(const Vec3f& eye, float side) const
+    {
+        if (cone_cos <= 0.f)
+            return false;
+        auto v = center - eye;
+        float along = Vec3f::dot(v, axis) * side;
+        float across = std::sqrt(std::max(0.f, Vec3f::dot(v, v) - along * along));
+        // запас на погрешность: ошибиться можно только на почти ребром видимой грани
+        return along * cone_cos - across * cone_sin > radius * 1.001f + 1e-4f * v.len();
+    }
+
+    int first, count;               // треугольники [first, first + count)
+    int vertex_first, vertex_count; // вершины в Mesh::meshlet_vertices
+    Vec3f center;                   // ограничивающая сфера в координатах модели
+    float radius;
+    Vec3f axis;                     // ось конуса нормалей граней
+    float cone_cos, cone_sin;       // половина раствора; cone_cos <= 0 - конус не отбрасывает
+};
+
+// Геометрия модели в координатах модели. После загрузки не меняется и общая у всех
+// копий модели (Model::clone), поэтому копия при редактировании не копирует сетку
+struct Mesh
+{
+    void buildMeshlets();
+
+    std::vector<uint32_t> index_buffer;
+    std::vector<Vertex> vertex_buffer;
+    std::vector<Face> faces;
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> meshlet_vertices; // вершины кластеров - номера в vertex_buffer
+    std::vector<uint8_t> meshlet_indices;   // по три локальных номера вершин кластера на треугольник
+};
+
 class Model
 {
 
@@ -37,6 +82,7 @@ public:
         auto step = wrap_angle(angle_x, angle, rot_step_x);
         angle_x = angle;
         rotation_matrix = rotation_matrix * Mat4x4f::RotationX(step);
+        box_valid = false;
     }
 
     virtual void rotateY(float angle)
@@ -44,6 +90,7 @@ public:
         auto step = wrap_angle(angle_y, angle, rot_step_y);
         angle_y = angle;
         rotation_matrix = rotation_matrix * Mat4x4f::RotationY(step);
+        box_valid = false;
     }
 
     virtual void rotateZ(float angle)
@@ -51,36 +98,43 @@ public:
         auto step = wrap_angle(angle_z, angle, rot_step_z);
         angle_z = angle;
         rotation_matrix = rotation_matrix * Mat4x4f::RotationZ(step);
+        box_valid = false;
     }
 
     virtual void shiftX(float dist)
     {
         shift_x = dist;
+        box_valid = false;
     }
 
     virtual void shiftY(float dist)
     {
         shift_y = dist;
+        box_valid = false;
     }
 
     virtual void shiftZ(float dist)
     {
         shift_z = dist;
+        box_valid = false;
     }
 
     void scaleX(float factor)
     {
         scale_x = factor;
+        box_valid = false;
     }
 
     void scaleY(float factor)
     {
         scale_y = factor;
+        box_valid = false;
     }
 
     void scaleZ(float factor)
     {
         scale_z = factor;
+        box_valid = false;
     }
 
     Mat4x4f objToWorld() const
@@ -90,14 +144,19 @@ public:
                Mat4x4f::Translation(shift_x, shift_y, shift_z);
     }
 
+    // цвет хранится в вершинах, поэтому сетка копируется: прежнюю держат снимки сцены
     void setColor(const Vec3f& color)
     {
-        for (auto& f: faces)
+        auto recolored = std::make_shared<Mesh>(*mesh);
+        for (auto& f: recolored->faces)
         {
             f.a.color = color;
             f.b.color = color;
             f.c.color = color;
         }
+        for (auto& v: recolored->vertex_buffer)
+            v.color = color;
+        mesh = recolored;
         this->color = color;
     }
 
@@ -107,17 +166,27 @@ public:
         return uid;
     }
 
-    virtual bool isObject()
+    virtual bool isObject() const
     {
         return true;
     }
 
+    // копия для copy-on-write: снимки сцены держат старую версию модели.
+    // Сетка у копии общая, копируются только преобразование и материал
+    virtual std::shared_ptr<Model> clone() const
+    {
+        return std::make_shared<Model>(*this);
+    }
+
     std::pair<data_intersect, data_intersect> interSect(const Vec3f& o, const Vec3f& d);
-    bool intersect(const Ray& ray, InterSectionData& data);
+    bool intersect(const Ray& ray, InterSectionData& data) const;
+
+    // цвет поверхности в точке треугольника (текстура или цвет вершин)
+    Vec3f surfaceColor(const Face& face, const Vec3f& bary) const;
 
     void genBox();
 
-//    virtual ~Model(){}
+    virtual ~Model(){}
 
 
 private:
@@ -131,13 +200,11 @@ private:
 
     bool triangleIntersect(const Face& face, const Ray& ray,
                            const Mat4x4f& objToWorld, const Mat4x4f& rotMatrix,
-                           InterSectionData& data);
+                           InterSectionData& data) const;
 
 
 public:
-    std::vector<uint32_t> index_buffer;
-    std::vector<Vertex> vertex_buffer;
-    std::vector<Face> faces;
+    std::shared_ptr<const Mesh> mesh = std::make_shared<const Mesh>();
     Mat4x4f rotation_matrix = Mat4x4f::Identity();
     Mat4x4f scale_matrix;
     QImage texture;
@@ -154,6 +221,7 @@ public:
 
     Vec3f color;
     BoundingBox box;
+    bool box_valid = false;
 
 private:
     float angle_x = 0.f, angle_y = 0.f, angle_z = 0.f;
@@ -164,7 +232,10 @@ private:
 
 struct InterSectionData
 {
-    Model model;
+    const Model* model = nullptr; // модель из закреплённого снимка сцены
+    int model_index = -1;         // её индекс в снимке
+    int face = -1;
+    Vec3f bary;
     float t;
     Vec3f point;
     Vec3f normal;
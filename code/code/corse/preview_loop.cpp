@@ -0,0 +1,90 @@
+﻿#include "preview_loop.h"
+
+class PreviewThread: public QThread
+{
+public:
+    PreviewThread(PreviewLoop* loop_): loop{loop_}{}
+
+protected:
+    void run() override
+    {
+        loop->work();
+    }
+
+private:
+    PreviewLoop* loop;
+};
+
+PreviewLoop::PreviewLoop(int interval_): interval{interval_}
+{
+    worker = new PreviewThread(this);
+    worker->start();
+}
+
+PreviewLoop::~PreviewLoop()
+{
+    {
+        QMutexLocker ml(&mutex);
+        stopping = true;
+        pending.reset();
+    }
+    has_scene.wakeAll();
+    worker->wait();
+    delete worker;
+}
+
+void PreviewLoop::submit(PreviewScenePtr scene, Renderer render)
+{
+    {
+        QMutexLocker ml(&mutex);
+        pending = std::move(scene);
+        renderer = std::move(render);
+    }
+    has_scene.wakeAll();
+}
+
+bool PreviewLoop::take(PreviewFrame& frame)
+{
+    QMutexLocker ml(&mutex);
+    if (!ready)
+        return false;
+    std::swap(frame, front);
+    ready = false;
+    return true;
+}
+
+void PreviewLoop::work()
+{
+    QMutexLocker ml(&mutex);
+    while (true)
+    {
+        while (!stopping && !pending)
+            has_scene.wait(&mutex);
+        if (stopping)
+            return;
+        // не чаще кадра за период: изменения, пришедшие за время ожидания,
+        // заменяют pending, и растеризуется только последнее
+        qint64 rest = clock.isValid() ? interval - clock.elapsed() : 0;
+        if (rest > 0)
+        {
+            has_scene.wait(&mutex, rest);
+            continue;
+        }
+        clock.start();
+        auto scene = std::move(pending);
+        pending.reset();
+        auto render = renderer;
+        ml.unlock();
+
+        render(*scene, back);
+        // модели кадра больше не нужны, и следующее изменение не копирует их
+        scene.reset();
+
+        ml.relock();
+        std::swap(back, front);
+        ready = true;
+        ml.unlock();
+        emit frameReady();
+        ml.relock();
+    }
+}
@@ -0,0 +1,78 @@
+﻿#ifndef PREVIEW_LOOP_H
+#define PREVIEW_LOOP_H
+#include <vector>
+#include <memory>
+#include <functional>
+#include <QObject>
+#include <QThread>
+#include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include "model.h"
+#include "camera.h"
+#include "raster.h"
+
+const int preview_interval = 16; // мс между началами кадров предпросмотра, примерно частота экрана
+
+// Состояние сцены для кадра предпросмотра. Модели разделяются с SceneManager
+// так же, как в SceneSnapshot: изменяется копия, поэтому кадр видит сцену
+// на момент захвата, а поток интерфейса не ждёт растеризации
+struct PreviewScene
+{
+    PreviewScene(const Camera& camera_, bool deferred_, uint64_t epoch_):
+        camera{camera_}, deferred{deferred_}, epoch{epoch_}{}
+
+    std::vector<std::shared_ptr<const Model>> models;
+    Camera camera;
+    bool deferred; // отложенное затенение
+    uint64_t epoch;
+};
+
+using PreviewScenePtr = std::shared_ptr<const PreviewScene>;
+
+// Готовый кадр предпросмотра
+struct PreviewFrame
+{
+    QImage image;
+    RasterStats stats;
+    uint64_t epoch = 0; // эпоха сцены, из которой получен кадр
+};
+
+// Фоновый поток предпросмотра. Изменения сцены только передают новое состояние;
+// поток растеризует последнее переданное не чаще раза за preview_interval
+// и сообщает о готовом кадре сигналом frameReady, кадр забирается через take
+class PreviewLoop: public QObject
+{
+    Q_OBJECT
+public:
+    using Renderer = std::function<void(const PreviewScene&, PreviewFrame&)>;
+
+    PreviewLoop(int interval_ = preview_interval);
+    ~PreviewLoop() override;
+
+    // заменяет ещё не начатое состояние, если оно есть
+    void submit(PreviewScenePtr scene, Renderer render);
+
+    // обменивает frame на последний готовый кадр. false - нового кадра нет
+    bool take(PreviewFrame& frame);
+
+    void work();
+
+signals:
+    void frameReady();
+
+private:
+    QThread* worker;
+    QMutex mutex;
+    QWaitCondition has_scene;
+    PreviewScenePtr pending;
+    Renderer renderer;
+    PreviewFrame back, front; // back пишет только поток предпросмотра
+    bool ready = false;       // в front кадр, который ещё не забран
+    QElapsedTimer clock;      // от начала предыдущего кадра
+    int interval;
+    bool stopping = false;
+};
+
+#endif // PREVIEW_LOOP_H
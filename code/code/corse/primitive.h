@@ -42,6 +42,8 @@ public:
     }
     virtual ~BoundingBox() override;
     virtual bool intersect(const Ray &ray) const override; // проверка пересечения
+    const Vec3f& lower() const { return bounds[0]; }
+    const Vec3f& upper() const { return bounds[1]; }
 private:
     Vec3f min;
     Vec3f max;
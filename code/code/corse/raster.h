@@ -0,0 +1,195 @@
+﻿#ifndef RASTER_H
+#define RASTER_H
+#include <cstdint>
+#include <memory>
+#include "vertex.h"
+#include "mat.h"
+#include "shaders.h"
+#include "primitive.h"
+
+class Model;
+struct Meshlet;
+
+const int subpixel_bits = 4;    // дробные биты экранных координат вершин
+const int raster_block = 8;     // сторона блока, отбрасываемого целиком (и блока буфера глубины)
+const float raster_limit = 1 << 26; // дальше координаты в фиксированной точке не помещаются в int64
+const float guard_band = 16.f;      // за |x|, |y| > guard_band * w треугольник отсекается боковыми плоскостями
+
+// рёберная функция E(x, y) = a*x + b*y + c в целых пикселях; E >= 0 - пиксель с внутренней
+// стороны ребра. На самом ребре пиксель достаётся только верхнему или левому ребру,
+// поэтому у общего ребра двух треугольников пиксель рисуется ровно один раз
+struct EdgeFunction
+{
+    EdgeFunction() = default;
+
+    EdgeFunction(int64_t x0, int64_t y0, int64_t x1, int64_t y1)
+    {
+        int64_t dx = x1 - x0, dy = y1 - y0;
+        // сдвиг отрицательного числа влево - неопределённое поведение, поэтому умножение
+        a = -dy * (int64_t(1) << subpixel_bits);
+        b = dx * (int64_t(1) << subpixel_bits);
+        // при обходе внутренность справа (ось y вниз): верхнее ребро горизонтально и идёт
+        // вправо, левое идёт вверх
+        bias = (dy < 0 || (dy == 0 && dx > 0)) ? 0 : 1;
+        c = dy * x0 - dx * y0 - bias;
+    }
+
+    int64_t at(int x, int y) const
+    {
+        return a * x + b * y + c;
+    }
+
+    // наибольшее и наименьшее значения в углах блока
+    int64_t maxIn(int x0, int y0, int x1, int y1) const
+    {
+        return at(a > 0 ? x1 : x0, b > 0 ? y1 : y0);
+    }
+
+    int64_t minIn(int x0, int y0, int x1, int y1) const
+    {
+        return at(a > 0 ? x0 : x1, b > 0 ? y0 : y1);
+    }
+
+    int64_t a = 0, b = 0, c = 0;
+    int bias = 0;
+};
+
+const int raster_tile = 64;   // сторона экранного тайла параллельной растеризации
+const int raster_chunk = 512; // треугольников (или вершин) в одной задаче вершинной обработки
+
+// статистика последнего кадра предпросмотра, для замеров
+struct RasterStats
+{
+    int models = 0;                   // моделей с геометрией
+    int culled_models = 0;            // из них отброшено целиком проверкой пирамиды видимости
+    int triangles = 0;                // треугольников в моделях
+    int culled_triangles = 0;         // из них в отброшенных моделях
+    int clusters = 0;                 // кластеров в оставшихся моделях
+    int frustum_clusters = 0;         // из них отброшено по пирамиде видимости
+    int backface_clusters = 0;        // и по конусу нормалей
+    int cluster_culled_triangles = 0; // треугольников в отброшенных кластерах
+    int rasterized = 0;               // треугольников после отбраковки и отсечения
+};
+
+// Пирамида видимости в мировых координатах: плоскости -w <= x, y <= w, 0 <= z <= w
+// пространства отсечения, выраженные через матрицу вид-проекция (вектор-строка)
+struct Frustum
+{
+    explicit Frustum(const Mat4x4f& viewProj)
+    {
+        auto column = [&](int j)
+        {
+            return Vec4f(viewProj.elements[0][j], viewProj.elements[1][j], viewProj.elements[2][j], viewProj.elements[3][j]);
+        };
+        auto x = column(0), y = column(1), z = column(2), w = column(3);
+        Vec4f planes_[6] = {w + x, w - x, w + y, w - y, z, w - z};
+        for (int i = 0; i < 6; i++)
+        {
+            normal[i] = Vec3f(planes_[i].x, planes_[i].y, planes_[i].z);
+            offset[i] = planes_[i].w;
+        }
+    }
+
+    // оболочка целиком за одной из плоскостей: за ней дальний по нормали угол
+    bool outside(const BoundingBox& box) const
+    {
+        auto& lo = box.lower();
+        auto& hi = box.upper();
+        for (int i = 0; i < 6; i++)
+        {
+            auto& n = normal[i];
+            Vec3f corner = {n.x > 0.f ? hi.x : lo.x, n.y > 0.f ? hi.y : lo.y, n.z > 0.f ? hi.z : lo.z};
+            if (Vec3f::dot(n, corner) + offset[i] < 0.f)
+                return true;
+        }
+        return false;
+    }
+
+    bool outside(const Vec3f& center, float radius) const
+    {
+        for (int i = 0; i < 6; i++)
+            if (Vec3f::dot(normal[i], center) + offset[i] < -radius * normal[i].len())
+                return true;
+        return false;
+    }
+
+    Vec3f normal[6];
+    float offset[6];
+};
+
+// шейдер пикселей модели; растеризатор инстанцирован для каждого
+enum class PixelShading
+{
+    color,
+    texture
+};
+
+// модель в кадре предпросмотра: её преобразования и шейдер пикселей
+struct RasterDraw
+{
+    const Model* model;
+    int index;             // номер модели в списке моделей сцены
+    PixelShading shading;
+    Mat4x4f rotation, objToWorld;
+};
+
+// кластер модели, прошедший отбраковку: номер модели в списке отрисовки, номера
+// его первого треугольника и первой вершины в общей нумерации кадра
+struct RasterCluster
+{
+    int draw;
+    const Meshlet* meshlet;
+    int first;
+    int base;
+};
+
+// Вершины кадра после вершинной обработки, по одной на вершину кластера.
+// Массивы раздельные: отбраковке нужны только координаты отсечения, а мировые
+// вершины - только при отсечении
+struct RasterVertices
+{
+    void resize(size_t n)
+    {
+        if (world.size() < n)
+        {
+            world.resize(n);
+            clip.resize(n);
+            projected.resize(n);
+        }
+    }
+
+    std::vector<Vertex> world;     // после шейдера вершин
+    std::vector<Vec4f> clip;       // координаты отсечения
+    std::vector<Vertex> projected; // после шейдера геометрии
+};
+
+// Треугольник после вершинной обработки, готовый к растеризации в любом тайле:
+// вершины в растровых координатах (обход по часовой стрелке), рёберные функции
+// и ограничивающий прямоугольник, уже обрезанный экраном
+struct RasterTriangle
+{
+    Vertex v[3];
+    EdgeFunction edges[3]; // edges[i] - ребро напротив вершины i
+    float inv_area;
+    int sx, ex, sy, ey;
+    // глубина: пределы по вершинам, плоскость z(x, y) для оценки по блокам
+    // и допуск на расхождение плоскости с барицентрической интерполяцией
+    float zmin, zmax, margin;
+    double z0, dzdx, dzdy;
+    int draw;              // номер модели в списке отрисовки кадра
+    // для буфера видимости: грань модели, номера её вершин в кадре и веса
+    // вершин грани в каждой вершине треугольника (после отсечения)
+    int face;
+    int ids[3];
+    Vec3f weight[3];
+
+    // барицентрические координаты пикселя по значениям в нём рёберных функций
+    Vec3f bary(const int64_t (&e)[3]) const
+    {
+        return {float(e[0] + edges[0].bias) * inv_area,
+                float(e[1] + edges[1].bias) * inv_area,
+                float(e[2] + edges[2].bias) * inv_area};
+    }
+};
+
+#endif // RASTER_H
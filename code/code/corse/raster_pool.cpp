@@ -0,0 +1,97 @@
+﻿#include "raster_pool.h"
+
+class RasterThread: public QThread
+{
+public:
+    RasterThread(RasterPool* pool_): pool{pool_}{}
+
+protected:
+    void run() override
+    {
+        pool->work();
+    }
+
+private:
+    RasterPool* pool;
+};
+
+// вызывающий поток тоже выполняет задачи, поэтому потоков пула на один меньше ядер
+RasterPool::RasterPool(int threads)
+{
+    for (int i = 1; i < threads; i++)
+    {
+        auto th = new RasterThread(this);
+        workers.push_back(th);
+        th->start();
+    }
+}
+
+RasterPool::~RasterPool()
+{
+    {
+        QMutexLocker ml(&mutex);
+        stopping = true;
+    }
+    has_tasks.wakeAll();
+    for (auto& th: workers)
+    {
+        th->wait();
+        delete th;
+    }
+}
+
+void RasterPool::runTasks()
+{
+    for (int i = next++; i < count; i = next++)
+    {
+        (*task)(i);
+        if (--pending == 0)
+        {
+            QMutexLocker ml(&mutex);
+            tasks_done.wakeAll();
+        }
+    }
+}
+
+void RasterPool::work()
+{
+    uint64_t seen = 0;
+    QMutexLocker ml(&mutex);
+    while (true)
+    {
+        while (!stopping && generation == seen)
+            has_tasks.wait(&mutex);
+        if (stopping)
+            return;
+        seen = generation;
+        busy++;
+        ml.unlock();
+        runTasks();
+        ml.relock();
+        if (--busy == 0)
+            tasks_done.wakeAll();
+    }
+}
+
+void RasterPool::forEach(int count_, const std::function<void(int)>& f)
+{
+    if (count_ <= 0)
+        return;
+    {
+        QMutexLocker ml(&mutex);
+        // поток, опоздавший к прошлому вызову, должен выйти из него до смены задачи
+        while (busy > 0)
+            tasks_done.wait(&mutex);
+        task = &f;
+        count = count_;
+        next = 0;
+        pending = count_;
+        generation++;
+    }
+    has_tasks.wakeAll();
+    runTasks();
+
+    QMutexLocker ml(&mutex);
+    while (pending > 0 || busy > 0)
+        tasks_done.wait(&mutex);
+}
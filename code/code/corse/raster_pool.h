@@ -0,0 +1,45 @@
+﻿#ifndef RASTER_POOL_H
+#define RASTER_POOL_H
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+
+// Постоянные потоки растеризации предпросмотра. В отличие от RenderPool работа
+// синхронная: forEach возвращается, когда выполнены все задачи, а вызывающий
+// поток выполняет задачи вместе с пулом. forEach вызывает один поток: у прохода
+// предпросмотра (поток PreviewLoop) и буфера видимости (поток интерфейса) пулы свои
+class RasterPool
+{
+public:
+    RasterPool(int threads = QThread::idealThreadCount());
+    ~RasterPool();
+
+    // f(i) для всех i от 0 до count - 1, в произвольном порядке и на разных потоках
+    void forEach(int count, const std::function<void(int)>& f);
+
+    int threads() const
+    {
+        return workers.size() + 1;
+    }
+
+    void work();
+
+private:
+    void runTasks();
+
+    std::vector<QThread*> workers;
+    QMutex mutex;
+    QWaitCondition has_tasks, tasks_done;
+    const std::function<void(int)>* task = nullptr;
+    int count = 0;
+    std::atomic<int> next{0};
+    std::atomic<int> pending{0};
+    int busy = 0;            // потоки пула внутри runTasks
+    uint64_t generation = 0; // номер вызова forEach
+    bool stopping = false;
+};
+
+#endif // RASTER_POOL_H
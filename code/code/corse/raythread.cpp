@@ -1,4 +1,5 @@
 ﻿#include "raythread.h"
+#include "render_pool.h"
 
 Vec3f RayThread::toWorld(int x, int y)
 {
@@ -8,28 +9,349 @@ Vec3f RayThread::toWorld(int x, int y)
     return res * inverse;
 }
 
-Vec3f RayThread::toWorld(const Vec3f &u, const Vec3f &v, const Vec3f &w, int x, int y)
+Vec3f RayThread::toWorld(const Vec3f &u, const Vec3f &v, const Vec3f &w, float x, float y)
 {
-    return u * float(x) - v * float(y) + w;
+    return u * x - v * y + w;
 }
 
 void RayThread::run()
 {
-    auto u = Vec3f::cross(cam->up, cam->direction).normalize();
-    auto v = cam->up.normalize();
+    RenderJob job;
+    while (pool->take(job))
+    {
+        if (job.frame->bounded)
+        {
+            // после срока оставшиеся тайлы только отмечаются выполненными
+            if (!job.frame->expired())
+            {
+                beginTile(*job.frame);
+                if (job.stage == 0)
+                    traceTileCoarse(*job.frame, job.bound, job.tile);
+                else
+                    traceTileRefine(*job.frame, job.bound);
+            }
+            pool->done(job);
+            continue;
+        }
+        if (job.stage > 0)
+        {
+            atrousPass(*job.frame, job.bound, job.stage - 1);
+            pool->done(job);
+            continue;
+        }
+        beginTile(*job.frame);
+        if (job.frame->settings.mode == path_tracing)
+            traceTilePath(*job.frame, job.bound);
+        else if (job.frame->settings.adaptive_aa)
+            traceTileAdaptive(*job.frame, job.bound);
+        else
+            traceTile(*job.frame, job.bound);
+        pool->done(job);
+    }
+}
+
+void RayThread::beginTile(const RenderFrame& frame)
+{
+    scene = frame.scene.get();
+    cam = &scene->camera;
+    inverse = frame.inverse;
+    width = frame.width;
+    height = frame.height;
+
+    pu = Vec3f::cross(cam->up, cam->direction).normalize();
+    pv = cam->up.normalize();
     auto w = -cam->direction.normalize();
 
-    auto w_ = u * float(-(width >> 1)) + v * float(height >> 1) - w * (float((height >> 1)) / tan(cam->fov / 2 * M_PI / 180));
+    pw = pu * float(-(width >> 1)) + pv * float(height >> 1) - w * (float((height >> 1)) / tan(cam->fov / 2 * M_PI / 180));
+}
+
+Vec3f RayThread::samplePixel(float x, float y, InterSectionData* hit, LightContrib* lc)
+{
+    if (hit)
+        hit->model = nullptr;
+    auto d = toWorld(pu, pv, pw, x, y).normalize();
+    return cast_ray(Ray(cam->position, d), 0, hit, lc);
+}
+
+// луч через центр пикселя: трассируется и записывается в gbuffer
+// либо, если геометрия не менялась, восстанавливается из него.
+// Попутно заполняется вклад источников света в пиксель, если он нужен кадру.
+// Без store буферы кадра не изменяются: пиксель принадлежит тайлу другого потока
+Vec3f RayThread::primarySample(const RenderFrame& frame, int x, int y, InterSectionData& hit, bool store)
+{
+    LightContrib contrib, *lc = nullptr;
+    if (frame.lights && store)
+    {
+        int n = frame.lights->lights;
+        contrib = {&frame.lights->visibility[size_t(y * width + x) * n]};
+        std::fill(contrib.visibility, contrib.visibility + n, 0);
+        lc = &contrib;
+    }
+
+    if (!frame.gbuffer)
+        return samplePixel(x, y, &hit, lc);
+
+    auto& texel = frame.gbuffer->texels[y * width + x];
+    if (!frame.reshade)
+    {
+        auto color = samplePixel(x, y, &hit, lc);
+        if (!store)
+            return color;
+        texel.model = hit.model ? hit.model_index : -1;
+        texel.face = hit.face;
+        texel.bary = hit.bary;
+        texel.point = hit.point;
+        texel.normal = hit.normal;
+        texel.t = hit.t;
+        return color;
+    }
+
+    hit.model = nullptr;
+    if (texel.model < 0)
+        return Vec3f{0.f, 0.f, 0.f};
+
+    auto model = scene->models[texel.model].get();
+    hit.model = model;
+    hit.model_index = texel.model;
+    hit.face = texel.face;
+    hit.bary = texel.bary;
+    hit.point = texel.point;
+    hit.normal = texel.normal;
+    hit.t = texel.t;
+    hit.color = model->surfaceColor(model->mesh->faces[texel.face], texel.bary);
+
+    auto d = toWorld(pu, pv, pw, x, y).normalize();
+    return shade(Ray(cam->position, d), hit, 0, lc);
+}
+
+void RayThread::traceTile(const RenderFrame& frame, const RayBound& bound)
+{
+    auto denoise = frame.denoise.get();
+    InterSectionData data;
+    scratch.row.resize(bound.xe - bound.xs + 1);
+    auto reprojection = frame.reprojection.get();
+    for (int y = bound.ys; y <= bound.ye; y++)
+    {
+        for (int x = bound.xs; x <= bound.xe; x++)
+        {
+            int source = reprojection ? reprojection->source[y * width + x] : -1;
+            if (source >= 0)
+            {
+                // попадание и цвет переносятся из предыдущего кадра без трассировки
+                if (!frame.reshade)
+                    frame.gbuffer->texels[y * width + x] = reprojection->gbuffer->texels[source];
+                scratch.row[x - bound.xs] = reprojection->pixels[(source / width) * reprojection->stride + source % width];
+                continue;
+            }
+            auto color = primarySample(frame, x, y, data);
+            if (denoise)
+            {
+                denoise->storeHit(y * width + x, data);
+                denoise->storeColor(y * width + x, color);
+            }
+            color *= 255.f;
+            scratch.row[x - bound.xs] = qRgb(color.x, color.y, color.z);
+        }
+        std::copy(scratch.row.begin(), scratch.row.end(), frame.pixels + y * frame.stride + bound.xs);
+    }
+}
+
+const float aa_normal_cos = 0.95f;
+const float r2_g = 1.32471795724474602596f; // число для последовательности R2
+
+inline float fract(float x)
+{
+    return x - std::floor(x);
+}
+
+// смещение k-го дополнительного отсчёта внутри пикселя: последовательность R2,
+// сдвинутая на хеш пикселя, чтобы соседние пиксели не давали одинаковый узор
+Vec3f sampleOffset(int k, int x, int y)
+{
+    uint32_t h = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u;
+    h = (h ^ (h >> 13)) * 0x5bd1e995u;
+    float sx = float(h & 0xffff) / 65536.f;
+    float sy = float(h >> 16) / 65536.f;
+    return {fract(sx + k / r2_g) - 0.5f, fract(sy + k / (r2_g * r2_g)) - 0.5f};
+}
+
+void RayThread::traceTileAdaptive(const RenderFrame& frame, const RayBound& bound)
+{
+    const auto& settings = frame.settings;
+
+    // первый проход: один луч на пиксель, с рамкой в пиксель вокруг тайла,
+    // чтобы сравнивать с соседями из других тайлов
+    int xs = std::max(bound.xs - 1, 0), xe = std::min(bound.xe + 1, width - 1);
+    int ys = std::max(bound.ys - 1, 0), ye = std::min(bound.ye + 1, height - 1);
+    int tw = xe - xs + 1, th = ye - ys + 1;
+
+    scratch.color.resize(tw * th);
+    scratch.normal.resize(tw * th);
+    scratch.hit.resize(tw * th);
 
-    for (int x = bound.xs; x <= bound.xe; x++)
+    InterSectionData data;
+    for (int y = ys; y <= ye; y++)
     {
-        for (int y = bound.ys; y <= bound.ye; y++)
+        for (int x = xs; x <= xe; x++)
         {
-            auto d = toWorld(u, v, w_, x, y).normalize();
-            auto color = cast_ray(Ray(cam->position, d)) * 255.f;
-            img.setPixelColor(x, y, QColor(color.x, color.y, color.z));
+            int i = (y - ys) * tw + (x - xs);
+            // рамку пишет поток соседнего тайла
+            bool inside = x >= bound.xs && x <= bound.xe && y >= bound.ys && y <= bound.ye;
+            scratch.color[i] = primarySample(frame, x, y, data, inside);
+            scratch.hit[i] = data.model;
+            scratch.normal[i] = data.normal;
+            if (frame.denoise && inside)
+                frame.denoise->storeHit(y * width + x, data);
         }
     }
 
-    emit finished();
+    auto differs = [&](int i, int j)
+    {
+        if (scratch.hit[i] != scratch.hit[j])
+            return true;
+        if (scratch.hit[i] && Vec3f::dot(scratch.normal[i], scratch.normal[j]) < aa_normal_cos)
+            return true;
+        auto c = scratch.color[i] - scratch.color[j];
+        return std::max({fabs(c.x), fabs(c.y), fabs(c.z)}) > settings.aa_threshold;
+    };
+
+    // второй проход: дополнительные отсчёты только там, где соседи различаются
+    int samples = std::max(settings.aa_max_samples, 1);
+    scratch.row.resize(bound.xe - bound.xs + 1);
+    for (int y = bound.ys; y <= bound.ye; y++)
+    {
+        for (int x = bound.xs; x <= bound.xe; x++)
+        {
+            int i = (y - ys) * tw + (x - xs);
+            auto color = scratch.color[i];
+            bool edge = (x > xs && differs(i, i - 1)) || (x < xe && differs(i, i + 1)) ||
+                        (y > ys && differs(i, i - tw)) || (y < ye && differs(i, i + tw));
+            if (edge && samples > 1)
+            {
+                for (int k = 1; k < samples; k++)
+                {
+                    auto o = sampleOffset(k, x, y);
+                    color += samplePixel(x + o.x, y + o.y);
+                }
+                color /= float(samples);
+            }
+            if (frame.denoise)
+                frame.denoise->storeColor(y * width + x, color);
+            color *= 255.f;
+            scratch.row[x - bound.xs] = qRgb(color.x, color.y, color.z);
+        }
+        std::copy(scratch.row.begin(), scratch.row.end(), frame.pixels + y * frame.stride + bound.xs);
+    }
+}
+
+void RayThread::traceTilePath(const RenderFrame& frame, const RayBound& bound)
+{
+    auto& sum = frame.accum->sum;
+    float inv_samples = 1.f / frame.accum_samples;
+    InterSectionData data;
+
+    scratch.row.resize(bound.xe - bound.xs + 1);
+    for (int y = bound.ys; y <= bound.ye; y++)
+    {
+        for (int x = bound.xs; x <= bound.xe; x++)
+        {
+            PathRng rng(x, y, frame.accum_samples);
+            // случайный сдвиг внутри пикселя сглаживает края по мере накопления
+            auto d = toWorld(pu, pv, pw, x + rng.next() - 0.5f, y + rng.next() - 0.5f).normalize();
+            auto& acc = sum[y * width + x];
+            data.model = nullptr;
+            acc += tracePath(cam->position, d, rng, &data);
+
+            auto color = acc * inv_samples;
+            if (frame.denoise)
+            {
+                frame.denoise->storeHit(y * width + x, data);
+                frame.denoise->storeColor(y * width + x, color);
+            }
+            color = color.saturate() * 255.f;
+            scratch.row[x - bound.xs] = qRgb(color.x, color.y, color.z);
+        }
+        std::copy(scratch.row.begin(), scratch.row.end(), frame.pixels + y * frame.stride + bound.xs);
+    }
+}
+
+const int coarse_step = 4;
+
+// грубый проход кадра к сроку: один луч на блок coarse_step x coarse_step, блок заливается
+// его цветом. Ошибка тайла оценивается по наибольшей разнице соседних отсчётов
+void RayThread::traceTileCoarse(const RenderFrame& frame, const RayBound& bound, int tile)
+{
+    int tw = (bound.xe - bound.xs) / coarse_step + 1;
+    int th = (bound.ye - bound.ys) / coarse_step + 1;
+    scratch.color.resize(tw * th);
+    scratch.hit.resize(tw * th);
+
+    InterSectionData data;
+    for (int by = 0; by < th; by++)
+    {
+        if (frame.expired())
+            return;
+        int y = bound.ys + by * coarse_step;
+        int ye = std::min(y + coarse_step - 1, bound.ye);
+        for (int bx = 0; bx < tw; bx++)
+        {
+            int x = bound.xs + bx * coarse_step;
+            int xe = std::min(x + coarse_step - 1, bound.xe);
+            auto color = samplePixel(x, y, &data);
+            scratch.color[by * tw + bx] = color;
+            scratch.hit[by * tw + bx] = data.model;
+
+            color *= 255.f;
+            auto rgb = qRgb(color.x, color.y, color.z);
+            for (int py = y; py <= ye; py++)
+                std::fill(frame.pixels + py * frame.stride + x, frame.pixels + py * frame.stride + xe + 1, rgb);
+        }
+    }
+
+    auto difference = [&](int i, int j)
+    {
+        // граница объектов - наибольшая ошибка
+        if (scratch.hit[i] != scratch.hit[j])
+            return 1.f;
+        auto c = scratch.color[i] - scratch.color[j];
+        return std::max({fabs(c.x), fabs(c.y), fabs(c.z)});
+    };
+    float error = 0.f;
+    for (int by = 0; by < th; by++)
+    {
+        for (int bx = 0; bx < tw; bx++)
+        {
+            int i = by * tw + bx;
+            if (bx + 1 < tw)
+                error = std::max(error, difference(i, i + 1));
+            if (by + 1 < th)
+                error = std::max(error, difference(i, i + tw));
+        }
+    }
+    frame.tile_error[tile] = error;
+}
+
+// уточнение тайла до луча на пиксель; отсчёты грубого прохода уже точные и не повторяются.
+// Срок проверяется по строкам, так что недоделанная часть тайла остаётся грубой
+void RayThread::traceTileRefine(const RenderFrame& frame, const RayBound& bound)
+{
+    scratch.row.resize(bound.xe - bound.xs + 1);
+    for (int y = bound.ys; y <= bound.ye; y++)
+    {
+        if (frame.expired())
+            return;
+        QRgb* row = frame.pixels + y * frame.stride;
+        bool coarse_row = (y - bound.ys) % coarse_step == 0;
+        for (int x = bound.xs; x <= bound.xe; x++)
+        {
+            if (coarse_row && (x - bound.xs) % coarse_step == 0)
+            {
+                scratch.row[x - bound.xs] = row[x];
+                continue;
+            }
+            auto color = samplePixel(x, y) * 255.f;
+            scratch.row[x - bound.xs] = qRgb(color.x, color.y, color.z);
+        }
+        std::copy(scratch.row.begin(), scratch.row.end(), row + bound.xs);
+    }
 }
@@ -3,6 +3,8 @@
 #include <QThread>
 #include <QImage>
 #include "light.h"
+#include "scene_snapshot.h"
+#include "sampling.h"
 
 struct RayBound
 {
@@ -10,36 +12,84 @@ struct RayBound
     int ys, ye;
 };
 
+enum trace_mode
+{
+    whitted,      // обратная трассировка лучей (по умолчанию)
+    path_tracing, // прогрессивная трассировка путей, один отсчёт на пиксель за кадр
+    hybrid        // первичная видимость растеризуется, трассируются только вторичные лучи
+};
+
+// Настройки трассировки кадра
+struct TraceSettings
+{
+    trace_mode mode = whitted;
+    bool adaptive_aa = false;
+    int aa_max_samples = 8;   // отсчётов на пиксель на границах
+    float aa_threshold = 0.1f; // допустимая разница цвета соседних пикселей
+    bool denoise = false;
+    bool temporal = false; // при движении камеры перепроецировать предыдущий кадр
+    int budget_ms = 0;     // кадр к сроку: лучшее изображение за это время, 0 - без ограничения
+};
+
+// Видимость источников из первичного попадания пикселя (см. LightCache)
+struct LightContrib
+{
+    uint8_t* visibility; // по байту на источник
+};
+
+struct RenderFrame;
+class RenderPool;
+
+// Память потока, переиспользуемая между тайлами и кадрами
+struct TraceScratch
+{
+    std::vector<QRgb> row;
+
+    // первый проход тайла с рамкой в один пиксель (адаптивное сглаживание)
+    std::vector<Vec3f> color;
+    std::vector<Vec3f> normal;
+    std::vector<const Model*> hit;
+
+    std::vector<int> lights; // точечные источники, достающие до точки
+};
+
 class RayThread: public QThread
 {
     Q_OBJECT
 public:
-    RayThread(Camera* cam_, QImage& img_, std::vector<Model*>& models_,
-              Mat4x4f& inverse_, RayBound& bound_, int width_, int height_):
-        cam{cam_}, img{img_}, models{models_}, inverse{inverse_},
-        bound{bound_}, width{width_}, height{height_}{}
+    RayThread(RenderPool* pool_): pool{pool_}{}
 protected:
     void run() override;
 
-signals:
-    void finished();
-
 private:
+    void beginTile(const RenderFrame& frame);
+    void traceTile(const RenderFrame& frame, const RayBound& bound);
+    void traceTileAdaptive(const RenderFrame& frame, const RayBound& bound);
+    void traceTilePath(const RenderFrame& frame, const RayBound& bound);
+    void traceTileCoarse(const RenderFrame& frame, const RayBound& bound, int tile);
+    void traceTileRefine(const RenderFrame& frame, const RayBound& bound);
+    Vec3f samplePixel(float x, float y, InterSectionData* hit = nullptr, LightContrib* lc = nullptr);
+    Vec3f primarySample(const RenderFrame& frame, int x, int y, InterSectionData& hit, bool store = true);
     Vec3f toWorld(int x, int y);
-    Vec3f toWorld(const Vec3f& u, const Vec3f& v, const Vec3f& w, int x, int y);
+    Vec3f toWorld(const Vec3f& u, const Vec3f& v, const Vec3f& w, float x, float y);
     Vec3f traceRay(const Vec3f& o, const Vec3f& d, float t_min, float t_max, int depth);
-    Vec3f cast_ray(const Ray& ray, int depth = 0);
-    Vec3f computeLightning(const Vec3f& p, const Vec3f& n, const Vec3f& direction, float specular,
-                           int depth = 0);
+    Vec3f cast_ray(const Ray& ray, int depth = 0, InterSectionData* primary = nullptr, LightContrib* lc = nullptr);
+    Vec3f shade(const Ray& ray, const InterSectionData& data, int depth, LightContrib* lc = nullptr);
+    Vec3f tracePath(const Vec3f& origin, const Vec3f& direction, PathRng& rng,
+                    InterSectionData* primary = nullptr);
+    Vec3f computeLightning(const InterSectionData& data, const Vec3f& direction, LightContrib* lc = nullptr,
+                           PathRng* rng = nullptr);
+    Vec3f ambientLight();
     bool sceneIntersect(const Ray& ray, InterSectionData& data, float t_max = 0.f);
 
 private:
-    QImage &img;
-    std::vector<Model*>& models;
+    RenderPool* pool;
+    TraceScratch scratch;
+    const SceneSnapshot* scene = nullptr; // снимок текущего тайла
     Mat4x4f inverse;
-    RayBound bound;
-    int width, height;
-    Camera* cam;
+    int width = 0, height = 0;
+    const Camera* cam = nullptr;
+    Vec3f pu, pv, pw; // базис плоскости изображения
 };
 
 #endif // RAYTHREAD_H
@@ -1,8 +1,14 @@
 ﻿#include "raythread.h"
 #include "scene_manager.h"
 #include <algorithm>
+#include "sampling.h"
+#include <cstring>
 
 const float eps_float = 1e-5;
+const int tile_size = 32;
+const float power_ref = 1.f; // влияет на прозранчость, с 1 просто стекло без преломления
+const int path_max_depth = 8, path_rr_depth = 3;
+const int light_budget = 8; // теневых лучей к точечным источникам на точку
 bool checkIntersection(const float& t, const float& t_min, const float& t_max, const float& closest_t)
 {
     return t > t_min && t < t_max && t < closest_t;
@@ -25,103 +31,191 @@ Vec3f refract(const Vec3f &I, const Vec3f &N, float eta_t, float eta_i=1.f) // S
 
 bool RayThread::sceneIntersect(const Ray &ray, InterSectionData &data, float t_max)
 {
-    float closeset_t = std::numeric_limits<float>::max();
-    bool intersected = false;
-    InterSectionData d;
-    for (auto& model: models)
+    return scene->flat->intersect(ray, data);
+}
+
+
+Vec3f RayThread::ambientLight()
+{
+    return scene->lights->ambient;
+}
+
+// прямое освещение точечными и направленными источниками (диффузная и зеркальная части).
+// Точечные источники берутся из дерева: только те, в радиус действия которых попадает точка,
+// а если таких больше light_budget - light_budget случайных пропорционально оценке вклада
+// с весом 1 / (light_budget * pdf). Без rng случайные числа определяются самой точкой,
+// и обратная трассировка остаётся детерминированной.
+// При lc в lc->visibility отмечаются источники, освещающие точку
+Vec3f RayThread::computeLightning(const InterSectionData& data, const Vec3f& direction, LightContrib* lc, PathRng* rng)
+{
+    const auto& lights = *scene->lights;
+    const auto& flat = *scene->flat;
+    float specular = flat.specular[data.model_index];
+    float n = flat.n[data.model_index];
+
+    float occlusion = 1e-4f;
+
+    Vec3f result = {0.f, 0.f, 0.f};
+
+    // освещённость от источника единичной интенсивности, 0 - точка в тени
+    auto unitTerm = [&](const Vec3f& lightDir, float distance)
     {
-        if (!model->isObject())
-            continue;
-        if (model->intersect(ray, d) && d.t < closeset_t)
-        {
-            closeset_t = d.t;
-            intersected = true;
-            data = d;
-            data.model = *model;
-        }
+        float term = lightTerm(lightDir, data.normal, direction, specular, n);
+        if (term <= 0.f)
+            return 0.f;
+
+        Vec3f shadow_orig = data.point + data.normal*occlusion; // checking if the point lies in the shadow of the lights[i]
+        InterSectionData tmpData;
+        if (sceneIntersect(Ray(shadow_orig, lightDir), tmpData))
+            if ((tmpData.point - shadow_orig).len() < distance)
+                return 0.f;
+        return term;
+    };
+    auto add = [&](const Vec3f& intensity, int slot, float term)
+    {
+        result += intensity * term;
+        if (lc && term > 0.f)
+            lc->visibility[slot] = 1;
+    };
+    auto pointLight = [&](int i, float weight)
+    {
+        auto& light = lights.points[i];
+        auto lightDir = light.position - data.point;
+        float distance = lightDir.len();
+        float falloff = lightFalloff(distance, light.radius);
+        if (falloff > 0.f)
+            add(light.intensity, light.slot, unitTerm(lightDir.normalize(), distance) * falloff * weight);
+    };
+
+    for (auto& light: lights.directional)
+        add(light.intensity, light.slot, unitTerm(light.direction, std::numeric_limits<float>::infinity()));
+
+    lights.collect(data.point, scratch.lights);
+    if (int(scratch.lights.size()) <= light_budget)
+    {
+        for (int i: scratch.lights)
+            pointLight(i, 1.f);
+        return result;
     }
 
-    return intersected;
+    uint32_t bits[3];
+    memcpy(bits, &data.point, sizeof(bits));
+    PathRng point_rng(bits[0], bits[1], bits[2]);
+    auto& r = rng ? *rng : point_rng;
+    // отсчёты расслоены: по одному на каждую 1 / light_budget часть отрезка
+    float offset = r.next();
+    for (int k = 0; k < light_budget; k++)
+    {
+        float pdf;
+        int i = lights.sample(data.point, data.normal, (k + offset) / light_budget, pdf);
+        if (i >= 0 && pdf > 0.f)
+            pointLight(i, 1.f / (light_budget * pdf));
+    }
+    return result;
 }
 
-
-Vec3f RayThread::cast_ray(const Ray &ray, int depth)
+Vec3f RayThread::cast_ray(const Ray &ray, int depth, InterSectionData* primary, LightContrib* lc)
 {
 
     InterSectionData data;
     if (depth > 2 || !sceneIntersect(ray, data))
         return Vec3f{0.f, 0, 0};
+    if (primary)
+        *primary = data;
 
-    float di = 1 - data.model.specular;
-
-    float distance = 0.f;
-
-    float occlusion = 1e-4f;
-
-    const float power_ref = 1.f; // влияет на прозранчость, с 1 просто стекло без преломления
+    return shade(ray, data, depth, lc);
+}
 
-    Vec3f ambient, diffuse = {0.f, 0.f, 0.f}, spec = {0.f, 0.f, 0.f}, lightDir = {0.f, 0.f, 0.f},
-            reflect_color = {0.f, 0.f, 0.f}, refract_color = {0.f, 0.f, 0.f};
+// lc заполняется только для первичного попадания: видимость источников из точки
+Vec3f RayThread::shade(const Ray &ray, const InterSectionData &data, int depth, LightContrib* lc)
+{
+    Vec3f reflect_color = {0.f, 0.f, 0.f}, refract_color = {0.f, 0.f, 0.f};
+    float reflective = scene->flat->reflective[data.model_index];
+    float refractive = scene->flat->refractive[data.model_index];
 
-    if (fabs(data.model.refractive) > 1e-5)
+    if (fabs(refractive) > 1e-5)
     {
         Vec3f refract_dir = refract(ray.direction, data.normal, power_ref).normalize();
         Vec3f refract_orig = Vec3f::dot(refract_dir, data.normal) < 0 ? data.point - data.normal * 1e-3f : data.point + data.normal * 1e3f;
         refract_color = cast_ray(Ray(refract_orig, refract_dir), depth + 1);
     }
 
-    if (fabs(data.model.reflective) > 1e-5)
+    if (fabs(reflective) > 1e-5)
     {
         Vec3f reflect_dir = reflect(ray.direction, data.normal).normalize();
         Vec3f reflect_orig = Vec3f::dot(reflect_dir, data.normal) < 0 ? data.point - data.normal * 1e-3f : data.point + data.normal * 1e-3f;
         reflect_color = cast_ray(Ray(reflect_orig, reflect_dir), depth + 1);
     }
 
-    for (auto &model: models)
+    return data.color.hadamard(ambientLight() +
+                               computeLightning(data, ray.direction, lc) +
+                               reflect_color * reflective +
+                               refract_color * refractive).saturate();
+}
+
+// один отсчёт пути: на каждом отрезке прямое освещение и случайный выбор
+// следующего направления по материалу (зеркало, прозрачность или диффузное рассеяние)
+Vec3f RayThread::tracePath(const Vec3f& origin, const Vec3f& direction, PathRng& rng, InterSectionData* primary)
+{
+    Vec3f radiance = {0.f, 0.f, 0.f}, throughput = {1.f, 1.f, 1.f};
+    Vec3f orig = origin, dir = direction;
+    auto ambient = ambientLight();
+
+    for (int bounce = 0; bounce < path_max_depth; bounce++)
     {
-        if (model->isObject())
-            continue;
-        Light* light = dynamic_cast<Light*>(model);
-        if (light->t == Light::light_type::ambient)
-            ambient = light->color_intensity;
-        else
+        Ray ray(orig, dir);
+        InterSectionData data;
+        if (!sceneIntersect(ray, data))
         {
-            if (light->t == Light::light_type::point)
-            {
-                lightDir = (light->position - data.point);
-                distance = lightDir.len();
-                lightDir = lightDir.normalize();
-            }
-            else
-            {
-                lightDir = light->getDirection();
-                distance = std::numeric_limits<float>::infinity();
-            }
+            // окружающий свет работает как равномерное небо для вторичных лучей
+            if (bounce > 0)
+                radiance += throughput.hadamard(ambient);
+            break;
+        }
+        if (bounce == 0 && primary)
+            *primary = data;
 
-            auto tDot = Vec3f::dot(lightDir, data.normal);
+        auto n = Vec3f::dot(ray.direction, data.normal) > 0 ? -data.normal : data.normal;
+        float p_refl = std::max(0.f, scene->flat->reflective[data.model_index]);
+        float p_refr = std::max(0.f, std::min(scene->flat->refractive[data.model_index], 1.f - p_refl));
+        float p_diff = std::max(0.f, 1.f - p_refl - p_refr);
 
-            Vec3f shadow_orig = tDot < 0 ? data.point - data.normal*occlusion : data.point + data.normal*occlusion; // checking if the point lies in the shadow of the lights[i]
-            InterSectionData tmpData;
-            if (sceneIntersect(Ray(shadow_orig, lightDir), tmpData))
-                if ((tmpData.point - shadow_orig).len() < distance)
-                    continue;
+        if (p_diff > 0.f)
+        {
+            InterSectionData lit = data;
+            lit.normal = n;
+            radiance += throughput.hadamard(data.color.hadamard(computeLightning(lit, ray.direction, nullptr, &rng))) * p_diff;
+        }
 
-            diffuse += (light->color_intensity * std::max(0.f, Vec3f::dot(data.normal, lightDir)) * di);
-            if (fabs(data.model.specular) < 1e-5)
-                continue;
-            auto r = reflect(lightDir, data.normal);
-            auto r_dot = Vec3f::dot(r, ray.direction);
-            auto power = powf(std::max(0.f, r_dot), data.model.n);
-            spec += light->color_intensity * power * data.model.specular;
+        float r = rng.next();
+        if (r < p_refl)
+        {
+            dir = reflect(ray.direction, n);
+            orig = data.point + n * 1e-3f;
         }
+        else if (r < p_refl + p_refr)
+        {
+            dir = refract(ray.direction, data.normal, power_ref).normalize();
+            orig = Vec3f::dot(dir, n) < 0 ? data.point - n * 1e-3f : data.point + n * 1e-3f;
+        }
+        else
+        {
+            dir = cosineHemisphere(n, rng.next(), rng.next());
+            orig = data.point + n * 1e-3f;
+        }
+        // вероятность выбора ветви сокращается с её весом в материале
+        throughput = throughput.hadamard(data.color);
 
+        if (bounce >= path_rr_depth)
+        {
+            float q = std::min(1.f, std::max({throughput.x, throughput.y, throughput.z, 0.05f}));
+            if (rng.next() > q)
+                break;
+            throughput /= q;
+        }
     }
 
-    return data.color.hadamard(ambient +
-                               diffuse +
-                               spec +
-                               reflect_color * data.model.reflective +
-                               refract_color * data.model.refractive).saturate();
+    return radiance;
 }
 
 Vec4f toWorld(int x, int y, const Mat4x4f& inverse, int width, int height)
@@ -158,39 +252,278 @@ std::vector<RayBound> subBlock(const RayBound& bound, int depth)
     return output;
 }
 
-std::vector<RayBound> split(int width, int height)
+std::vector<RayBound> split(const RayBound& area)
 {
-    int cnt = 8;
-    int step = height / cnt;
-    int start = 0;
+    // мелкие тайлы выравнивают нагрузку между потоками пула
     std::vector<RayBound> output;
-    for (int i = 0; i < cnt; ++i)
+    for (int ys = area.ys; ys <= area.ye; ys += tile_size)
+        for (int xs = area.xs; xs <= area.xe; xs += tile_size)
+            output.push_back(RayBound{.xs = xs, .xe = std::min(xs + tile_size - 1, area.xe),
+                                      .ys = ys, .ye = std::min(ys + tile_size - 1, area.ye)});
+    return output;
+}
+
+std::vector<RayBound> split(int width, int height)
+{
+    return split(RayBound{.xs = 0, .xe = width - 1, .ys = 0, .ye = height - 1});
+}
+
+bool SceneManager::trace()
+{
+    if (!pool)
+        return false;
+    auto start = std::chrono::steady_clock::now();
+    auto snap = snapshot();
+    auto previous = current_frame;
+    current_frame = std::make_shared<RenderFrame>(snap, width, height, trace_settings);
+    // кадр к сроку: грубый проход всего кадра, затем уточнение тайлов, пока есть время.
+    // Кадр может остаться недоделанным, поэтому общие буферы (gbuffer, вклады источников)
+    // в нём не заполняются. Трассировка путей и так выдаёт изображение после каждого отсчёта
+    if (trace_settings.budget_ms > 0 && trace_settings.mode != path_tracing)
     {
-        output.push_back(RayBound{.xs = 0, .xe = width - 1, .ys = start, .ye = (start + step - 1) % height});
-        start += step;
+        auto tiles = split(width, height);
+        current_frame->bounded = true;
+        current_frame->deadline = start + std::chrono::milliseconds(trace_settings.budget_ms);
+        current_frame->tile_error.assign(tiles.size(), 0.f);
+        current_frame->stages = 1;
+        pool->submit(current_frame, tiles);
+        return true;
     }
-    return output;
+    if (trace_settings.mode == path_tracing)
+    {
+        // накопление продолжается, пока сцена не изменилась
+        if (!accum || accum->version != snap->version)
+            accum = std::make_shared<Accumulation>(width * height, snap->version);
+        current_frame->accum = accum;
+        current_frame->accum_samples = ++accum->samples;
+    }
+    if (trace_settings.mode != path_tracing)
+    {
+        // первичные попадания прежние, если не менялись камера и геометрия;
+        // растеризованные попадания менее точны, и обычная трассировка их не использует
+        if (gbuffer && gbuffer->geometry_version == snap->geometry_version &&
+            gbuffer->width == width && gbuffer->height == height &&
+            (trace_settings.mode == hybrid || !gbuffer->approximate))
+            current_frame->reshade = true;
+        else
+        {
+            auto prev_gbuffer = gbuffer;
+            gbuffer = std::make_shared<GBuffer>(width, height, snap->geometry_version);
+            // гибридный режим: первичная видимость от растеризатора, от лучей только вторичные
+            if (trace_settings.mode == hybrid)
+            {
+                rasterizeVisibility(*snap, *gbuffer);
+                current_frame->reshade = true;
+            }
+            // сдвинулась только камера: большая часть пикселей переносится из предыдущего кадра
+            if (trace_settings.temporal && !trace_settings.adaptive_aa && previous && previous->finished &&
+                previous->gbuffer == prev_gbuffer && prev_gbuffer && prev_gbuffer->width == width &&
+                prev_gbuffer->height == height && previous->scene->content_version == snap->content_version)
+            {
+                auto reprojection = reproject(*prev_gbuffer, previous->image, *snap, temporal_frame++);
+                reprojection->gbuffer = prev_gbuffer;
+                current_frame->reprojection = reprojection;
+                gbuffer->approximate = true;
+            }
+        }
+        current_frame->gbuffer = gbuffer;
+
+        // видимость источников нужна, чтобы потом менять их интенсивность без трассировки;
+        // при сглаживании пиксель усредняет несколько отсчётов, и кэш не ведётся,
+        // как и для пикселей, перенесённых из предыдущего кадра. Пересчёт по кэшу не
+        // проходит фильтр шумоподавления и заменил бы отфильтрованный кадр шумным.
+        // При большом числе источников кэш не заводится совсем, чтобы не занимать память.
+        // Если точечных источников больше light_budget, они выбираются случайно по яркости,
+        // и видимость невыбранных (например, выключенных) источников неизвестна
+        int lights = snap->lights->count;
+        if (!trace_settings.adaptive_aa && !trace_settings.denoise && !current_frame->reprojection &&
+            int(snap->lights->points.size()) <= light_budget && size_t(width) * height * lights <= light_cache_limit)
+        {
+            if (!light_cache || light_cache->width != width || light_cache->height != height ||
+                light_cache->lights != lights)
+                light_cache = std::make_shared<LightCache>(width, height, lights, snap->shading_version);
+            light_cache->shading_version = snap->shading_version;
+            current_frame->lights = light_cache;
+        }
+        else
+            light_cache.reset();
+    }
+    // перенесённые пиксели уже прошли фильтр в предыдущем кадре
+    if (trace_settings.denoise && !current_frame->reprojection)
+    {
+        // буферы переиспользуются: кадры трассируются по одному
+        if (!denoise_buffers || denoise_buffers->width != width || denoise_buffers->height != height)
+            denoise_buffers = std::make_shared<DenoiseBuffers>(width, height);
+        current_frame->denoise = denoise_buffers;
+        current_frame->stages = denoise_passes;
+    }
+    pool->submit(current_frame, split(width, height));
+    return true;
+}
+
+// одна сцена с нескольких камер (круговой обзор, стереопара, грани кубической карты).
+// Снимок с оболочками моделей строится один раз, кадры отличаются только камерой,
+// а их тайлы чередуются в общей очереди пула. Трассировка путей накапливает отсчёты
+// между кадрами одной камеры, поэтому в пакете кадры трассируются обратной трассировкой
+bool SceneManager::traceBatch(const std::vector<Camera>& cameras)
+{
+    if (!pool || cameras.empty())
+        return false;
+    auto snap = snapshot();
+    auto settings = trace_settings;
+    if (settings.mode == path_tracing)
+        settings.mode = whitted;
+
+    batch_frames.clear();
+    for (auto& camera: cameras)
+    {
+        auto view = std::make_shared<SceneSnapshot>(*snap);
+        view->camera = camera;
+        auto frame = std::make_shared<RenderFrame>(view, width, height, settings);
+        if (settings.mode == hybrid)
+        {
+            frame->gbuffer = std::make_shared<GBuffer>(width, height, view->geometry_version);
+            rasterizeVisibility(*view, *frame->gbuffer);
+            frame->reshade = true;
+        }
+        if (settings.denoise)
+        {
+            frame->denoise = std::make_shared<DenoiseBuffers>(width, height);
+            frame->stages = denoise_passes;
+        }
+        batch_frames.push_back(frame);
+    }
+    pool->submitBatch(batch_frames, split(width, height));
+    return true;
+}
+
+// круговой обзор: текущая камера, повёрнутая views раз вокруг вертикальной оси сцены
+bool SceneManager::traceTurntable(int views)
+{
+    std::vector<Camera> cameras;
+    for (int k = 0; k < views; k++)
+    {
+        auto camera = camers[curr_camera];
+        float angle = 360.f * k / views;
+        camera.position = camera.position * Mat3x3f::RotationY(angle);
+        camera.rotateY(angle);
+        cameras.push_back(camera);
+    }
+    return traceBatch(cameras);
 }
 
-ThreadVector* SceneManager::trace()
+// повторная трассировка прямоугольника roi (например, вокруг настраиваемого стеклянного
+// объекта), остальное изображение берётся из предыдущего кадра. Тайлы области ставятся
+// в начало очереди пула. Область трассируется обратной трассировкой, с supersample -
+// с полным числом отсчётов сглаживания на каждый пиксель
+bool SceneManager::traceRegion(RayBound roi, bool supersample)
 {
-    img.fill(Qt::black);
-    auto v = split(width, height);
-    auto cam = camers[curr_camera];
-    auto origin = cam.position;
-    auto mat = cam.viewMatrix() * cam.projectionMatrix;
-    auto inverse = Mat4x4f::Inverse(mat);
+    if (!pool)
+        return false;
+    roi.xs = std::max(roi.xs, 0);
+    roi.ys = std::max(roi.ys, 0);
+    roi.xe = std::min(roi.xe, width - 1);
+    roi.ye = std::min(roi.ye, height - 1);
+    if (roi.xs > roi.xe || roi.ys > roi.ye)
+        return false;
 
-    for (auto& model: models)
-        if (model->isObject())
-            model->genBox();
+    auto settings = trace_settings;
+    settings.mode = whitted;
+    settings.denoise = false;
+    settings.budget_ms = 0;
+    if (supersample)
+    {
+        settings.adaptive_aa = true;
+        settings.aa_threshold = -1.f;
+    }
+    auto frame = std::make_shared<RenderFrame>(snapshot(), width, height, settings);
+    frame->priority = true;
 
-    for (auto& bound: v)
+    // вне области остаётся последний трассированный кадр, а если его нет - предпросмотр
+    const QImage& base = current_frame && current_frame->finished ? current_frame->image : preview_frame.image;
+    for (int y = 0; y < height; y++)
     {
-        auto th = new RayThread(&camers[curr_camera], img,  models, inverse, bound, width, height);
-        threads.push_back(th);
+        auto line = reinterpret_cast<const QRgb*>(base.constScanLine(y));
+        std::copy(line, line + width, frame->pixels + y * frame->stride);
     }
 
-    return &threads;
+    current_frame = frame;
+    pool->submit(current_frame, split(roi));
+    return true;
+}
+
+std::vector<QImage> SceneManager::batchImages() const
+{
+    std::vector<QImage> images;
+    for (auto& frame: batch_frames)
+        images.push_back(frame->image);
+    return images;
+}
+
+// пересборка трассированного изображения после изменения интенсивности источников:
+// попадания (GBuffer) и видимость источников прежние, поэтому лучи не трассируются,
+// а прямое освещение первичных точек считается заново так же, как при трассировке
+bool SceneManager::relight()
+{
+    if (!current_frame || !current_frame->finished || !current_frame->lights || !current_frame->gbuffer)
+        return false;
+    auto cache = current_frame->lights;
+    auto snap = snapshot();
+    if (cache->shading_version != snap->shading_version)
+        return false;
+
+    const auto& lights = *snap->lights;
+    if (lights.count != cache->lights)
+        return false;
+
+    auto& frame = *current_frame;
+    const auto& flat = *snap->flat;
+    // отражённый и преломлённый свет тоже зависит от интенсивностей, а его лучи не
+    // кэшируются: кадр с такими попаданиями пересчитывается трассировкой
+    for (auto& texel: frame.gbuffer->texels)
+        if (texel.model >= 0 && (fabs(flat.reflective[texel.model]) > 1e-5 || fabs(flat.refractive[texel.model]) > 1e-5))
+            return false;
+    const auto& eye = snap->camera.position;
+    std::vector<int> in_range;
+    for (int y = 0; y < frame.height; y++)
+    {
+        QRgb* row = frame.pixels + y * frame.stride;
+        for (int x = 0; x < frame.width; x++)
+        {
+            int i = y * frame.width + x;
+            auto& texel = frame.gbuffer->texels[i];
+            if (texel.model < 0)
+            {
+                row[x] = qRgb(0, 0, 0);
+                continue;
+            }
+            const uint8_t* visible = &cache->visibility[size_t(i) * cache->lights];
+            auto& model = *snap->models[texel.model];
+            float specular = flat.specular[texel.model], n = flat.n[texel.model];
+            auto view = (texel.point - eye).normalize();
 
+            Vec3f direct = {0.f, 0.f, 0.f};
+            for (auto& light: lights.directional)
+                if (visible[light.slot])
+                    direct += light.intensity * lightTerm(light.direction, texel.normal, view, specular, n);
+            // источники в том же порядке, что и при трассировке
+            lights.collect(texel.point, in_range);
+            for (int k: in_range)
+            {
+                auto& light = lights.points[k];
+                if (!visible[light.slot])
+                    continue;
+                auto light_dir = light.position - texel.point;
+                float distance = light_dir.len();
+                float term = lightTerm(light_dir.normalize(), texel.normal, view, specular, n);
+                direct += light.intensity * (term * lightFalloff(distance, light.radius));
+            }
+
+            auto color = model.surfaceColor(model.mesh->faces[texel.face], texel.bary);
+            color = color.hadamard(lights.ambient + direct).saturate() * 255.f;
+            row[x] = qRgb(color.x, color.y, color.z);
+        }
+    }
+    show(frame.image);
+    return true;
 }
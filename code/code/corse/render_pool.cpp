@@ -0,0 +1,143 @@
+﻿#include "render_pool.h"
+#include <numeric>
+#include <algorithm>
+
+RenderFrame::RenderFrame(SnapshotPtr scene_, int width_, int height_, const TraceSettings& settings_):
+    scene{scene_}, settings{settings_}, width{width_}, height{height_}
+{
+    auto& cam = scene->camera;
+    inverse = Mat4x4f::Inverse(cam.viewMatrix() * cam.projectionMatrix);
+
+    image = QImage(width, height, QImage::Format_RGB32);
+    image.fill(Qt::black);
+    // потоки пишут прямо в буфер, без detach() у QImage на каждый пиксель
+    pixels = reinterpret_cast<QRgb*>(image.bits());
+    stride = image.bytesPerLine() / sizeof(QRgb);
+}
+
+RenderPool::RenderPool(int threads)
+{
+    if (threads < 1)
+        threads = 1;
+    for (int i = 0; i < threads; i++)
+    {
+        auto th = new RayThread(this);
+        workers.push_back(th);
+        th->start();
+    }
+}
+
+RenderPool::~RenderPool()
+{
+    {
+        QMutexLocker ml(&mutex);
+        stopping = true;
+        jobs.clear();
+    }
+    has_jobs.wakeAll();
+    for (auto& th: workers)
+    {
+        th->wait();
+        delete th;
+    }
+}
+
+void RenderPool::submit(const FramePtr& frame, const std::vector<RayBound>& tiles)
+{
+    if (tiles.empty())
+        return;
+    frame->tiles = tiles;
+    submitStage(frame, 0);
+}
+
+// тайлы всех кадров чередуются в очереди: пока дотрассировываются последние тайлы
+// одного кадра, свободные потоки уже заняты остальными
+void RenderPool::submitBatch(const std::vector<FramePtr>& frames, const std::vector<RayBound>& tiles)
+{
+    if (frames.empty() || tiles.empty())
+        return;
+    auto batch = std::make_shared<RenderBatch>();
+    batch->remaining = frames.size();
+    for (auto& frame: frames)
+    {
+        frame->tiles = tiles;
+        frame->batch = batch;
+        frame->remaining = tiles.size();
+    }
+    {
+        QMutexLocker ml(&mutex);
+        for (size_t i = 0; i < tiles.size(); i++)
+            for (auto& frame: frames)
+                jobs.push_back(RenderJob{frame, tiles[i], 0, int(i)});
+    }
+    has_jobs.wakeAll();
+}
+
+void RenderPool::submitStage(const FramePtr& frame, int stage)
+{
+    frame->remaining = frame->tiles.size();
+    {
+        QMutexLocker ml(&mutex);
+        auto pos = frame->priority ? jobs.begin() : jobs.end();
+        for (size_t i = 0; i < frame->tiles.size(); i++)
+            pos = jobs.insert(pos, RenderJob{frame, frame->tiles[i], stage, int(i)}) + 1;
+    }
+    has_jobs.wakeAll();
+}
+
+// тайлы с наибольшей оценкой ошибки уточняются первыми
+void RenderPool::orderByError(RenderFrame& frame)
+{
+    std::vector<int> order(frame.tiles.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+    {
+        return frame.tile_error[a] > frame.tile_error[b];
+    });
+    std::vector<RayBound> tiles;
+    std::vector<float> error;
+    for (int i: order)
+    {
+        tiles.push_back(frame.tiles[i]);
+        error.push_back(frame.tile_error[i]);
+    }
+    frame.tiles.swap(tiles);
+    frame.tile_error.swap(error);
+}
+
+bool RenderPool::take(RenderJob& job)
+{
+    QMutexLocker ml(&mutex);
+    while (jobs.empty() && !stopping)
+        has_jobs.wait(&mutex);
+    if (stopping)
+        return false;
+    job = jobs.front();
+    jobs.pop_front();
+    return true;
+}
+
+void RenderPool::done(RenderJob& job)
+{
+    if (--job.frame->remaining == 0)
+    {
+        // следующий этап начинается только после того, как весь кадр прошёл текущий;
+        // у кадра к сроку после истечения времени этапов больше нет
+        if (job.stage < job.frame->stages && !job.frame->expired())
+        {
+            if (job.frame->bounded)
+                orderByError(*job.frame);
+            submitStage(job.frame, job.stage + 1);
+        }
+        else
+        {
+            job.frame->finished = true;
+            if (!job.frame->batch)
+                emit frameFinished();
+            else if (--job.frame->batch->remaining == 0)
+                emit batchFinished();
+        }
+    }
+    // простаивающий поток не должен удерживать снимок сцены
+    job.frame.reset();
+}
@@ -0,0 +1,113 @@
+﻿#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <QObject>
+#include <QMutex>
+#include <QWaitCondition>
+#include "raythread.h"
+#include "denoiser.h"
+#include "gbuffer.h"
+#include "temporal.h"
+
+// Накопленная сумма отсчётов трассировки путей. Сбрасывается,
+// когда меняется версия сцены
+struct Accumulation
+{
+    Accumulation(int size, uint64_t version_): sum(size, Vec3f{0.f, 0.f, 0.f}), version{version_}{}
+
+    std::vector<Vec3f> sum;
+    int samples = 0;
+    uint64_t version;
+};
+
+// Пакет кадров одной сцены с разных камер
+struct RenderBatch
+{
+    std::atomic<int> remaining{0}; // незавершённые кадры
+};
+
+// Кадр трассировки: общий для всех тайлов, владеет итоговым изображением
+struct RenderFrame
+{
+    RenderFrame(SnapshotPtr scene_, int width_, int height_, const TraceSettings& settings_ = {});
+
+    SnapshotPtr scene;
+    TraceSettings settings;
+    Mat4x4f inverse;
+    int width, height;
+    QImage image;
+    QRgb* pixels;
+    int stride;
+    std::shared_ptr<Accumulation> accum;
+    int accum_samples = 0; // число отсчётов с учётом этого кадра
+    std::shared_ptr<DenoiseBuffers> denoise;
+    std::shared_ptr<GBuffer> gbuffer;
+    bool reshade = false; // первичные лучи не трассируются, попадания берутся из gbuffer
+    std::shared_ptr<LightCache> lights;
+    std::shared_ptr<const Reprojection> reprojection; // пиксели, взятые из предыдущего кадра
+    std::vector<RayBound> tiles;
+    int stages = 0; // этапы после трассировки (проходы фильтра)
+    std::atomic<int> remaining{0};
+    std::atomic<bool> finished{false};
+    std::shared_ptr<RenderBatch> batch; // кадр входит в пакет, завершение сообщается по пакету
+    bool priority = false;              // тайлы ставятся в начало очереди
+
+    // кадр к сроку: этап 0 - грубый проход, этап 1 - уточнение тайлов по убыванию ошибки
+    bool bounded = false;
+    std::chrono::steady_clock::time_point deadline;
+    mutable std::vector<float> tile_error; // каждый тайл пишет только свой элемент
+
+    bool expired() const
+    {
+        return bounded && std::chrono::steady_clock::now() >= deadline;
+    }
+};
+
+using FramePtr = std::shared_ptr<RenderFrame>;
+
+struct RenderJob
+{
+    FramePtr frame;
+    RayBound bound;
+    int stage = 0; // 0 - трассировка, далее проходы шумоподавления
+    int tile = 0;  // номер тайла в RenderFrame::tiles
+};
+
+// Постоянный пул потоков трассировки: потоки создаются один раз,
+// кадры передаются в виде очереди тайлов
+class RenderPool: public QObject
+{
+    Q_OBJECT
+public:
+    RenderPool(int threads = QThread::idealThreadCount());
+    ~RenderPool() override;
+
+    void submit(const FramePtr& frame, const std::vector<RayBound>& tiles);
+
+    void submitBatch(const std::vector<FramePtr>& frames, const std::vector<RayBound>& tiles);
+
+    bool take(RenderJob& job);
+
+    void done(RenderJob& job);
+
+private:
+    void submitStage(const FramePtr& frame, int stage);
+
+    void orderByError(RenderFrame& frame);
+
+signals:
+    void frameFinished();
+
+    void batchFinished();
+
+private:
+    std::vector<RayThread*> workers;
+    std::deque<RenderJob> jobs;
+    QMutex mutex;
+    QWaitCondition has_jobs;
+    bool stopping = false;
+};
+
+#endif // RENDER_POOL_H
@@ -0,0 +1,48 @@
+﻿#ifndef SAMPLING_H
+#define SAMPLING_H
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+#include "vec3.h"
+
+// Генератор случайных чисел для стохастических режимов (xorshift32).
+// Зерно зависит от пикселя и номера кадра, поэтому кадры не повторяют друг друга.
+struct PathRng
+{
+    PathRng(uint32_t x, uint32_t y, uint32_t frame)
+    {
+        state = x * 1973u + y * 9277u + frame * 26699u;
+        state = (state ^ 61u) ^ (state >> 16);
+        state *= 9u;
+        state ^= state >> 4;
+        state *= 0x27d4eb2du;
+        state ^= state >> 15;
+        state |= 1u;
+    }
+
+    float next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (1.f / 16777216.f);
+    }
+
+    uint32_t state;
+};
+
+// направление с косинусным распределением в полусфере вокруг нормали n
+inline Vec3f cosineHemisphere(const Vec3f& n, float u1, float u2)
+{
+    float r = std::sqrt(u1);
+    float phi = 2.f * float(M_PI) * u2;
+    float x = r * std::cos(phi), y = r * std::sin(phi);
+    float z = std::sqrt(std::max(0.f, 1.f - u1));
+
+    auto t = fabs(n.x) > 0.9f ? Vec3f{0.f, 1.f, 0.f} : Vec3f{1.f, 0.f, 0.f};
+    auto b1 = Vec3f::cross(n, t).normalize();
+    auto b2 = Vec3f::cross(n, b1);
+    return (b1 * x + b2 * y + n * z).normalize();
+}
+
+#endif // SAMPLING_H
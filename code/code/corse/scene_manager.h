@@ -9,7 +9,13 @@
 #include "light.h"
 #include "color_shader.h"
 #include "vertex_shader.h"
-#include "raythread.h"
+#include "geometry_shader.h"
+#include "render_pool.h"
+#include "scene_snapshot.h"
+#include "raster.h"
+#include "depth_buffer.h"
+#include "raster_pool.h"
+#include "preview_loop.h"
 #include <QtDebug>
 #include <QMutex>
 
@@ -21,10 +27,25 @@ enum trans_type
     up_y, down_y
 };
 
-using ThreadVector = std::vector<RayThread*>;
-
 const Vec3f pointLightPosition = {0.f, 0.f, -5.f}, directionLightPosition = {0.f, 0.f, -5.f};
 
+// Буферы и потоки одного прохода растеризации. Проходов два - кадр предпросмотра
+// (поток PreviewLoop) и буфер видимости гибридного режима (поток интерфейса), буферы
+// и пулы у них свои, поэтому поток интерфейса не ждёт кадр предпросмотра
+struct RasterBuffers
+{
+    std::shared_ptr<RasterPool> pool;
+    std::vector<RasterDraw> draws;
+    std::vector<RasterCluster> clusters;     // кластеры кадра, прошедшие отбраковку
+    RasterVertices vertices;                 // вершины кадра
+    std::vector<std::vector<RasterTriangle>> triangles; // треугольники кадра по группам
+    std::vector<std::vector<int>> bins;      // [группа * число тайлов + тайл] - треугольники тайла
+    std::vector<const RasterTriangle*> visibility; // видимый треугольник пикселя
+    DepthBuffer depth;
+    int chunks = 0;                          // групп треугольников в кадре
+    int tiles_x = 0, tiles = 0;
+};
+
 class SceneManager
 {
 
@@ -35,13 +56,16 @@ public:
     SceneManager(int width_, int height_, QColor background_color_, QGraphicsScene* scene_): width{width_}, height{height_},
         background_color(background_color_), scene{scene_}{
 
-        img = QImage(width, height, QImage::Format_RGB32);
-        depthBuffer.resize(width);
-        for (auto &vec : depthBuffer)
-            vec.resize(height, std::numeric_limits<float>::max());
-        img.fill(background_color);
+        preview_frame.image = QImage(width, height, QImage::Format_RGB32);
+        preview_raster.depth.resize(width, height);
+        visibility_raster.depth.resize(width, height);
+        preview_frame.image.fill(background_color);
 
         camers.push_back(Camera(width, height));
+        pool = std::make_shared<RenderPool>();
+        preview_raster.pool = std::make_shared<RasterPool>();
+        visibility_raster.pool = std::make_shared<RasterPool>();
+        preview = std::make_shared<PreviewLoop>();
     }
 
     void init();
@@ -78,51 +102,148 @@ public:
 
     void setRefraction(float refract);
 
-    void setIntensity(float intens);
+    // false - показанное трассированное изображение не пересчитать по кэшу,
+    // его нужно перетрассировать
+    bool setIntensity(float intens);
+
+    bool setAmbIntensity(float intensity);
+
+    void setAntialiasing(bool enabled, int max_samples, float threshold);
+
+    void setTraceMode(trace_mode mode);
+
+    void setDenoise(bool enabled);
+
+    void setTemporal(bool enabled);
+
+    void setTimeBudget(int milliseconds);
+
+    void setDeferredShading(bool enabled);
+
+    // статистика показанного кадра предпросмотра
+    const RasterStats& rasterStats() const
+    {
+        return preview_frame.stats;
+    }
+
+    int accumulatedSamples() const
+    {
+        return accum ? accum->samples : 0;
+    }
+
+    bool trace();
+
+    bool traceBatch(const std::vector<Camera>& cameras);
 
-    void setAmbIntensity(float intensity);
+    bool traceRegion(RayBound roi, bool supersample);
 
-    ThreadVector* trace();
+    bool traceTurntable(int views);
+
+    std::vector<QImage> batchImages() const;
 
     void showTracedResult();
 
+    bool relight();
+
+    RenderPool* renderPool()
+    {
+        return pool.get();
+    }
+
+    PreviewLoop* previewLoop()
+    {
+        return preview.get();
+    }
+
+    // показ готового кадра предпросмотра, вызывается по PreviewLoop::frameReady
+    void showPreview();
+
     void render();
 
+    SnapshotPtr snapshot();
+
 private:
-    void render_all();
+    void requestPreview();
+
+    void render_all(const PreviewScene& state, PreviewFrame& frame);
+
+    void show(const QImage& image);
+
+    Model* edit(int index);
+
+    Model* editIntensity(int index);
+
+    bool updateIntensity();
+
+    Model* edit()
+    {
+        return edit(current_model);
+    }
+
+    void setupPass(RasterBuffers& buffers, const std::vector<std::shared_ptr<const Model>>& scene_models,
+                   const Camera& cam, bool visibility, RasterStats& stats);
+
+    void setupFace(RasterBuffers& buffers, const RasterDraw& draw, int face, const int (&ids)[3], const Mat4x4f& view,
+                   const Mat4x4f& projection, const Vec3f& eye, bool cull, std::vector<RasterTriangle>& out);
 
-    void rasterize(Model& model);
+    bool setupTriangle(RasterTriangle& tri);
 
-    void show();
+    template<typename Draw>
+    void drawTile(RasterBuffers& buffers, int tile, Draw draw);
 
-    void rasterBarTriangle(Vertex p1_, Vertex p2_, Vertex p3_);
+    template<typename Fragment>
+    bool rasterTriangle(DepthBuffer& depth, const RasterTriangle& tri, int x0, int y0, int x1, int y1, Fragment fragment);
 
-    bool testAndSet(const Vec3f& p);
+    void shadeVisible(const RasterBuffers& buffers, int x0, int y0, int x1, int y1, QRgb* pixels, int stride);
 
-    bool backfaceCulling(const Vertex& a, const Vertex& b, const Vertex& c);
+    void rasterizeVisibility(const SceneSnapshot& snap, GBuffer& buffer);
 
-    bool clip(const Vertex& p);
+    bool backfaceCulling(const Vertex& a, const Vertex& b, const Vertex& c, const Vec3f& eye);
 
 private:
     std::vector<Camera> camers;
     int curr_camera = 0;
-    std::vector<Model*> models;
+    std::vector<std::shared_ptr<Model>> models;
     int width, height;
-    std::vector<std::vector<float>> depthBuffer;
-    QImage img;
+    PreviewFrame preview_frame; // показанный кадр предпросмотра
     QColor background_color;
     QGraphicsScene *scene;
 
-    std::shared_ptr<PixelShaderInterface> pixel_shader;
-    std::shared_ptr<VertexShaderInterface> vertex_shader;
-    std::shared_ptr<GeometryShaderInterface> geom_shader;
+    VertexShader vertex_shader;
+    GeometryShader geom_shader;
 
     uint32_t models_index = 1;
     int current_model = 0;
     float vw = 1.f, vh = 1.f;
     float d = 1.f;
 
-    ThreadVector threads;
+    std::shared_ptr<RenderPool> pool;
+    RasterBuffers preview_raster;    // только поток предпросмотра
+    RasterBuffers visibility_raster; // только поток интерфейса
+    bool deferred_shading = true;
+    FramePtr current_frame;
+    std::vector<FramePtr> batch_frames;
+    TraceSettings trace_settings;
+    std::shared_ptr<Accumulation> accum;
+    std::shared_ptr<DenoiseBuffers> denoise_buffers;
+    std::shared_ptr<GBuffer> gbuffer;
+    std::shared_ptr<LightCache> light_cache;
+
+    uint64_t scene_version = 1;
+    uint64_t geometry_version = 1;
+    uint64_t shading_version = 1;
+    uint64_t content_version = 1;
+    uint64_t object_version = 1;
+    int temporal_frame = 0;
+    SnapshotPtr published;
+
+    // объявлен последним: поток предпросмотра останавливается раньше, чем
+    // разрушаются буферы растеризации, с которыми он работает
+    std::shared_ptr<PreviewLoop> preview;
+    bool preview_busy = false;  // кадр захвачен и ещё не показан
+    bool preview_dirty = false; // сцена менялась после захвата
+    bool traced_shown = false;  // на экране трассированное изображение, а не предпросмотр
+    uint64_t preview_epoch = 0;
 
 };
 #endif // SCENE_MANAGER_H
@@ -0,0 +1,33 @@
+﻿#ifndef SCENE_SNAPSHOT_H
+#define SCENE_SNAPSHOT_H
+#include <vector>
+#include <memory>
+#include "light.h"
+#include "camera.h"
+#include "light_tree.h"
+#include "flat_scene.h"
+
+// Неизменяемая версия сцены. Модели разделяются между версиями:
+// SceneManager копирует модель только при первом изменении после публикации,
+// поэтому трассировка может идти параллельно с редактированием.
+struct SceneSnapshot
+{
+    SceneSnapshot(const Camera& camera_, uint64_t version_, uint64_t geometry_version_, uint64_t shading_version_,
+                  uint64_t content_version_, uint64_t object_version_):
+        camera{camera_}, version{version_}, geometry_version{geometry_version_}, shading_version{shading_version_},
+        content_version{content_version_}, object_version{object_version_}{}
+
+    std::vector<std::shared_ptr<const Model>> models;
+    std::shared_ptr<const FlatScene> flat;   // массивы объектов и материалов для трассировки
+    std::shared_ptr<const LightTree> lights; // оба строятся один раз на версию содержимого
+    Camera camera;
+    uint64_t version;
+    uint64_t geometry_version; // меняется только при изменении геометрии или камеры
+    uint64_t shading_version;  // меняется при всех изменениях, кроме интенсивности источников
+    uint64_t content_version;  // меняется при всех изменениях, кроме движения камеры
+    uint64_t object_version;   // то же, но не меняется и при изменении интенсивности источников
+};
+
+using SnapshotPtr = std::shared_ptr<const SceneSnapshot>;
+
+#endif // SCENE_SNAPSHOT_H
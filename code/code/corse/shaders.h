@@ -23,29 +23,4 @@ inline float GammaCorrect(float value)
     return 1.055f * std::pow(value, (1.f / 2.4f)) - 0.055f;
 }
 
-
-class PixelShaderInterface
-{
-public:
-    virtual Vec3f shade(const Vertex& a, const Vertex& b, const Vertex&c, const Vec3f& bary) = 0;
-    virtual ~PixelShaderInterface(){}
-};
-
-class VertexShaderInterface
-{
-public:
-    virtual Vertex shade(const Vertex &a,
-                         const Mat4x4f& rotation,
-                         const Mat4x4f& objToWorld,
-                         const Camera& cam) = 0;
-    virtual ~VertexShaderInterface(){}
-};
-
-class GeometryShaderInterface
-{
-public:
-    virtual Vertex shade(const Vertex &a,
-                         const Mat4x4f& projectMatrix, const Mat4x4f& camView) = 0;
-    virtual ~GeometryShaderInterface(){}
-};
 #endif // SHADERS_H
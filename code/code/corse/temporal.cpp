@@ -0,0 +1,99 @@
+﻿#include "temporal.h"
+#include <algorithm>
+
+// порядок обновления пикселей внутри блока 4x4: обновляемые за кадр пиксели разнесены
+static const int bayer4[4][4] =
+{
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5}
+};
+
+std::shared_ptr<Reprojection> reproject(const GBuffer& prev_gbuffer, const QImage& prev_image,
+                                        const SceneSnapshot& scene, int frame_index)
+{
+    int width = prev_gbuffer.width, height = prev_gbuffer.height;
+    auto out = std::make_shared<Reprojection>(width, height);
+    auto& source = out->source;
+
+    const auto& cam = scene.camera;
+    auto viewProj = cam.viewMatrix() * cam.projectionMatrix;
+
+    std::vector<float> depth(width * height, std::numeric_limits<float>::infinity());
+    for (int j = 0; j < width * height; j++)
+    {
+        auto& texel = prev_gbuffer.texels[j];
+        // промахи дешёвые, а фон мог закрыться - такие пиксели трассируются
+        if (texel.model < 0)
+            continue;
+        // отражение, преломление и блики зависят от положения камеры
+        auto& model = *scene.models[texel.model];
+        if (fabs(model.reflective) > 1e-5 || fabs(model.refractive) > 1e-5 || fabs(model.specular) >= 1e-5)
+            continue;
+        auto to_point = texel.point - cam.position;
+        if (Vec3f::dot(texel.normal, to_point) > 0.f)
+            continue;
+
+        auto p = Vec4f(texel.point) * viewProj;
+        if (p.w < cam.zn)
+            continue;
+        int x = std::lround((p.x / p.w + 1.f) * (width >> 1));
+        int y = std::lround((1.f - p.y / p.w) * (height >> 1));
+        if (x < 0 || y < 0 || x >= width || y >= height)
+            continue;
+
+        int i = y * width + x;
+        float d = to_point.len();
+        if (d < depth[i])
+        {
+            depth[i] = d;
+            source[i] = j;
+        }
+    }
+
+    out->image = prev_image;
+    out->pixels = reinterpret_cast<const QRgb*>(out->image.constBits());
+    out->stride = out->image.bytesPerLine() / sizeof(QRgb);
+    auto color = [&](int j)
+    {
+        return out->pixels[(j / width) * out->stride + j % width];
+    };
+
+    // пиксель берётся из предыдущего кадра, только если он продолжает поверхность соседей;
+    // иначе это край объекта или фон, просвечивающий между разнесёнными попаданиями.
+    // Перенесённый отсчёт лежит не в центре пикселя, поэтому резкие границы
+    // (тени, текстуры) тоже перетрассируются, чтобы не сдвигаться
+    auto continuous = [&](int i, int n)
+    {
+        if (source[n] < 0)
+            return true;
+        if (depth[n] < depth[i] * (1.f - temporal_depth_tolerance))
+            return false;
+        auto& a = prev_gbuffer.texels[source[i]];
+        auto& b = prev_gbuffer.texels[source[n]];
+        if (a.model != b.model || Vec3f::dot(a.normal, b.normal) < temporal_normal_cos)
+            return false;
+        QRgb ca = color(source[i]), cb = color(source[n]);
+        return std::max({abs(qRed(ca) - qRed(cb)), abs(qGreen(ca) - qGreen(cb)), abs(qBlue(ca) - qBlue(cb))}) <= temporal_color_tolerance;
+    };
+
+    std::vector<int> valid(width * height, -1);
+    int refresh = frame_index % temporal_refresh;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int i = y * width + x;
+            if (source[i] < 0 || bayer4[y & 3][x & 3] == refresh)
+                continue;
+            if ((x > 0 && !continuous(i, i - 1)) || (x + 1 < width && !continuous(i, i + 1)) ||
+                (y > 0 && !continuous(i, i - width)) || (y + 1 < height && !continuous(i, i + width)))
+                continue;
+            valid[i] = source[i];
+            out->reused++;
+        }
+    }
+    source.swap(valid);
+    return out;
+}
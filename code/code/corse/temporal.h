@@ -0,0 +1,33 @@
+﻿#ifndef TEMPORAL_H
+#define TEMPORAL_H
+#include <vector>
+#include <memory>
+#include <QImage>
+#include "gbuffer.h"
+#include "scene_snapshot.h"
+
+const int temporal_refresh = 16; // каждый пиксель перетрассируется не реже, чем раз в 16 кадров
+const float temporal_depth_tolerance = 0.05f;
+const float temporal_normal_cos = 0.9f;
+const int temporal_color_tolerance = 24; // из 255
+
+// Предыдущий кадр, перенесённый в новую камеру
+struct Reprojection
+{
+    Reprojection(int width, int height): source(width * height, -1){}
+
+    std::vector<int> source; // пиксель предыдущего кадра или -1, если пиксель трассируется заново
+    std::shared_ptr<const GBuffer> gbuffer; // попадания предыдущего кадра
+    QImage image;                           // цвет предыдущего кадра
+    const QRgb* pixels = nullptr;
+    int stride = 0;
+    int reused = 0;
+};
+
+// Перенос попаданий предыдущего кадра в камеру scene: ближайшее попадание на пиксель,
+// затем отбрасываются пиксели на разрывах глубины, нормали и цвета, зеркальные и прозрачные
+// поверхности и очередная часть пикселей для обновления
+std::shared_ptr<Reprojection> reproject(const GBuffer& prev_gbuffer, const QImage& prev_image,
+                                        const SceneSnapshot& scene, int frame_index);
+
+#endif // TEMPORAL_H
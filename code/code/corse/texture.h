@@ -2,15 +2,39 @@
 #define TEXTURE_H
 
 #include "shaders.h"
+#include "bary.h"
 #include <QImage>
-class TextureShader: public PixelShaderInterface
+
+// текстура модели, умноженная на цвет вершин. Шейдер только ссылается на текстуры
+// модели (в формате ARGB32), поэтому создаётся на месте без выделения памяти
+class TextureShader
 {
 public:
-    TextureShader(const QImage& img);
-    virtual Vec3f shade(const Vertex &a, const Vertex &b, const Vertex &c, const Vec3f &bary) override;
-    virtual ~TextureShader(){}
+    explicit TextureShader(const QImage& img):
+        texels{reinterpret_cast<const QRgb*>(img.constBits())}, stride{img.bytesPerLine() / int(sizeof(QRgb))},
+        width{img.width()}, height{img.height()}{}
+
+    Vec3f shade(const Vertex &a, const Vertex &b, const Vertex &c, const Vec3f &bary) const
+    {
+        float pixel_z = interPolateCord(a.invW, b.invW, c.invW, bary);
+        float invZ = 1 / pixel_z;
+
+        auto face_color = baryCentricInterpolation(a.color, b.color, c.color, bary);
+
+        float pixel_u = interPolateCord(a.u , b.u, c.u, bary) * invZ;
+        float pixel_v = interPolateCord(a.v, b.v, c.v, bary) * invZ;
+
+        int x = Clamp(int(std::floor(pixel_u * width - 1)), 0, width - 1);
+        int y = Clamp(int(std::floor(pixel_v * (height - 1))), 0, height - 1);
+
+        auto color = texels[y * stride + x];
+        Vec3f pixel_color = Vec3f{qRed(color) / 255.f, qGreen(color) / 255.f, qBlue(color) / 255.f};
+        return pixel_color.hadamard(face_color).saturate();
+    }
+
 private:
-    QImage texture;
+    const QRgb* texels;
+    int stride, width, height;
 };
 
 #endif // TEXTURE_H
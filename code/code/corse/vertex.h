@@ -6,11 +6,12 @@
 class Vertex
 {
 public:
+    Vertex() = default;
     Vertex(Vec3f pos_, Vec3f normal_, float u_, float v_, Vec3f color_ = {0.5, 0.5, 0.5}):
         pos{pos_}, normal{normal_}, color{color_}, u{u_}, v{v_}{}
 public:
     Vec3f pos, normal, color;
-    float u, v;
+    float u = 0.f, v = 0.f;
     float invW = 1.f;
 };
 #endif // VERTEX_H
@@ -1,6 +1,6 @@
 ﻿#include "vertex_shader.h"
 
-Vertex VertexShader::shade(const Vertex &a, const Mat4x4f& rotMatrix, const Mat4x4f& objToWorld, const Camera& cam)
+Vertex VertexShader::shade(const Vertex &a, const Mat4x4f& rotMatrix, const Mat4x4f& objToWorld, const Camera& cam) const
 {
     Vec4f res(a.pos);
     res = res * objToWorld;
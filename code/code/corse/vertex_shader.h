@@ -3,7 +3,7 @@
 #include "shaders.h"
 #include "mat.h"
 
-class VertexShader: public VertexShaderInterface
+class VertexShader
 {
 public:
     VertexShader(const Vec3f& dir_ = {0.f, 0.f, 1.f},
@@ -13,8 +13,7 @@ public:
     Vertex shade(const Vertex &a,
                  const Mat4x4f& rotationMatrix,
                  const Mat4x4f& objToWorld,
-                 const Camera& cam) override;
-    ~VertexShader() override{}
+                 const Camera& cam) const;
 private:
     Vec3f dir;
     Vec3f light_color;